@@ -0,0 +1,171 @@
+// Standalone benchmark of the CombMask kernels.
+//
+// Usage: combmask_bench [min_ms] [filter] [offset]
+//     min_ms - minimal measuring time per kernel and plane size (default 200).
+//     filter - run only kernels whose name contains this string (e.g. "AVX2", "16-bit").
+//     offset - start the rows this many pixels after an aligned address, like a cropped frame (default 0).
+//
+// Reported numbers are for the best run. GB/s counts one read of the source plane and one write of the mask,
+// cycles/pixel are TSC (reference) cycles.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#include "MTCombMask.h"
+#include "VCL2/instrset.h"
+
+using kernel_t = void (*)(uint8_t* __restrict, const uint8_t*, int, int, const int, int, int, int) noexcept;
+
+struct Kernel
+{
+    std::string name;
+    int iset;
+    int bits;
+    kernel_t fn;
+};
+
+struct PlaneSize
+{
+    const char* name;
+    int width;
+    int height;
+};
+
+template <typename T, int peak, int bits>
+static void add_kernels(std::vector<Kernel>& kernels)
+{
+    const std::string format{ (bits == 32) ? "float" : std::to_string(bits) + "-bit" };
+
+    kernels.push_back({ "C " + format, 0, bits, CM_C<T, peak, bits> });
+    kernels.push_back({ "SSE2 " + format, 2, bits, CM_SSE2<T, peak, bits> });
+    if constexpr (std::is_same_v<T, uint16_t>)
+        kernels.push_back({ "SSE41 " + format, 5, bits, CM_SSE41<T, peak, bits> });
+    if constexpr (std::is_same_v<T, float>)
+        kernels.push_back({ "AVX " + format, 7, bits, CM_AVX<T, peak, bits> });
+    kernels.push_back({ "AVX2 " + format, 8, bits, CM_AVX2<T, peak, bits> });
+    kernels.push_back({ "AVX512 " + format, 10, bits, CM_AVX512<T, peak, bits> });
+}
+
+template <typename T>
+static void fill_plane(uint8_t* p, int pitch, int width, int height, int bits)
+{
+    std::mt19937 gen{ 12345 };
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        T* row{ reinterpret_cast<T*>(p + static_cast<int64_t>(y) * pitch) };
+
+        // Alternate the level of every other line so that a part of the plane is combed.
+        for (int x{ 0 }; x < width; ++x)
+        {
+            if constexpr (std::is_same_v<T, float>)
+                row[x] = ((y & 1) ? 0.6f : 0.3f) + (gen() % 1000) / 10000.0f;
+            else
+                row[x] = static_cast<T>((((y & 1) ? 150 : 90) + static_cast<int>(gen() % 40)) << (bits - 8));
+        }
+    }
+}
+
+static uint8_t* align_ptr(std::vector<uint8_t>& buf)
+{
+    return reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(buf.data()) + 63) & ~static_cast<uintptr_t>(63));
+}
+
+int main(int argc, char** argv)
+{
+    const double min_ms{ (argc > 1) ? atof(argv[1]) : 200.0 };
+    const std::string filter{ (argc > 2) ? argv[2] : "" };
+    const int offset{ (argc > 3) ? atoi(argv[3]) : 0 };
+
+    std::vector<Kernel> kernels;
+    add_kernels<uint8_t, 255, 8>(kernels);
+    add_kernels<uint16_t, 1023, 10>(kernels);
+    add_kernels<uint16_t, 4095, 12>(kernels);
+    add_kernels<uint16_t, 16383, 14>(kernels);
+    add_kernels<uint16_t, 65535, 16>(kernels);
+    add_kernels<float, 1, 32>(kernels);
+
+    const PlaneSize sizes[]{ { "SD", 720, 480 }, { "HD", 1920, 1080 }, { "UHD", 3840, 2160 }, { "8K", 7680, 4320 } };
+    const int iset{ instrset_detect() };
+
+    printf("%-16s %-5s %10s %10s %10s\n", "kernel", "size", "ns/pixel", "GB/s", "cycles/px");
+
+    for (auto& size : sizes)
+    {
+        for (auto& k : kernels)
+        {
+            if (k.iset > iset || (!filter.empty() && k.name.find(filter) == std::string::npos))
+                continue;
+
+            const int sample_size{ (k.bits == 8) ? 1 : (k.bits == 32) ? 4 : 2 };
+            const int row_size{ size.width * sample_size };
+            const int pitch{ (row_size + offset * sample_size + 63) & ~63 };
+
+            std::vector<uint8_t> src_buf(static_cast<size_t>(pitch) * size.height + 64);
+            std::vector<uint8_t> dst_buf(static_cast<size_t>(pitch) * size.height + 64);
+            uint8_t* srcp{ align_ptr(src_buf) + offset * sample_size };
+            uint8_t* dstp{ align_ptr(dst_buf) + offset * sample_size };
+
+            if (k.bits == 8)
+                fill_plane<uint8_t>(srcp, pitch, size.width, size.height, 8);
+            else if (k.bits == 32)
+                fill_plane<float>(srcp, pitch, size.width, size.height, 32);
+            else
+                fill_plane<uint16_t>(srcp, pitch, size.width, size.height, k.bits);
+
+            // Same threshold scaling as the CombMask constructor.
+            int th1{ 30 };
+            int th2{ 30 };
+            if (k.bits > 8 && k.bits < 32)
+            {
+                const int scale{ static_cast<int>(((1 << k.bits) - 1) / 255.0 + 0.5) };
+                th1 *= scale;
+                th2 *= scale;
+            }
+
+            // The first and the last row aren't processed by the kernels.
+            uint8_t* dstp_inner{ dstp + pitch };
+            const uint8_t* srcp_inner{ srcp + pitch };
+
+            k.fn(dstp_inner, srcp_inner, pitch, pitch, size.height - 2, row_size, th1, th2);
+
+            double best_ns{ 1e300 };
+            uint64_t best_cycles{ UINT64_MAX };
+            double total_ms{ 0.0 };
+            int runs{ 0 };
+
+            while (total_ms < min_ms || runs < 3)
+            {
+                const auto t0{ std::chrono::steady_clock::now() };
+                const uint64_t c0{ __rdtsc() };
+                k.fn(dstp_inner, srcp_inner, pitch, pitch, size.height - 2, row_size, th1, th2);
+                const uint64_t c1{ __rdtsc() };
+                const auto t1{ std::chrono::steady_clock::now() };
+
+                const double ns{ std::chrono::duration<double, std::nano>(t1 - t0).count() };
+                best_ns = std::min(best_ns, ns);
+                best_cycles = std::min(best_cycles, c1 - c0);
+                total_ms += ns / 1e6;
+                ++runs;
+            }
+
+            const double pixels{ static_cast<double>(size.width) * size.height };
+            const double bytes{ 2.0 * pixels * sample_size };
+
+            printf("%-16s %-5s %10.3f %10.2f %10.3f\n", k.name.c_str(), size.name, best_ns / pixels, bytes / best_ns, best_cycles / pixels);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include "FrameCache.h"
+
+FrameCache::FrameCache(size_t _budget) : budget(_budget), used(0)
+{
+}
+
+bool FrameCache::get(int n, PVideoFrame& frame)
+{
+    std::lock_guard<std::mutex> lock(mtx);
+
+    const auto it{ index.find(n) };
+    if (it == index.end())
+        return false;
+
+    entries.splice(entries.begin(), entries, it->second);
+    frame = it->second->frame;
+
+    return true;
+}
+
+void FrameCache::put(int n, const PVideoFrame& frame, size_t bytes)
+{
+    if (bytes > budget)
+        return;
+
+    // Evicted frames are released after the lock, the last reference may free a frame buffer.
+    std::list<Entry> evicted;
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        // Another thread may have made the same frame meanwhile.
+        if (index.count(n))
+            return;
+
+        while (used + bytes > budget)
+        {
+            used -= entries.back().bytes;
+            index.erase(entries.back().n);
+            evicted.splice(evicted.begin(), entries, std::prev(entries.end()));
+        }
+
+        entries.push_front(Entry{ n, frame, bytes });
+        index.emplace(n, entries.begin());
+        used += bytes;
+    }
+}
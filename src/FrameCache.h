@@ -0,0 +1,36 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "avisynth.h"
+
+// Least recently used frames returned by a filter, up to a memory budget.
+// The frames are kept by reference, a hit returns the same frame without copying it.
+class FrameCache
+{
+    struct Entry
+    {
+        int n;
+        PVideoFrame frame;
+        size_t bytes;
+    };
+
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<int, std::list<Entry>::iterator> index;
+    size_t budget;
+    size_t used;
+    std::mutex mtx;
+
+public:
+    explicit FrameCache(size_t _budget);
+
+    FrameCache(const FrameCache&) = delete;
+    FrameCache& operator=(const FrameCache&) = delete;
+
+    bool get(int n, PVideoFrame& frame);
+    // Frames larger than the whole budget aren't kept.
+    void put(int n, const PVideoFrame& frame, size_t bytes);
+};
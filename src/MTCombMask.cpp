@@ -16,115 +16,231 @@
 // Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA, or visit
 // http://www.gnu.org/copyleft/gpl.html .
 
+#include <array>
+#include <cmath>
+
 #include "MTCombMask.h"
 #include "VCL2/instrset.h"
 
-template <typename T, int peak, int bits>
-static void CM_C(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept
+static const char* packed_names[3]{ "CombMaskPackedY", "CombMaskPackedU", "CombMaskPackedV" };
+
+// Copies a plane of a high bit depth or float clip to an 8-bit plane.
+template <typename T, int bits>
+static void convert_to_8bit(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, int width, int height, bool chroma) noexcept
 {
-    dst_pitch /= sizeof(T);
     src_pitch /= sizeof(T);
     width /= sizeof(T);
-    const T* su{ reinterpret_cast<const T*>(srcp_) };
-    T* __restrict d{ reinterpret_cast<T*>(dstp_) };
+    const T* srcp{ reinterpret_cast<const T*>(srcp_) };
 
-    const T* s{ su + src_pitch };
-    const T* sd{ su + static_cast<int64_t>(2) * src_pitch };
-
-    if constexpr (std::is_same_v<T, uint8_t>)
+    for (int y{ 0 }; y < height; ++y)
     {
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
-
-        for (int y{ 1 }; y < height - 1; ++y)
+        for (int x{ 0 }; x < width; ++x)
         {
-            for (int x{ 0 }; x < width; ++x)
-            {
-                const int prod{ (su[x] - s[x]) * (sd[x] - s[x]) };
-
-                if (prod < thresinf)
-                    d[x] = 0;
-                else if (prod > thressup)
-                    d[x] = 255;
-                else
-                    d[x] = prod >> 8;
-            }
+            if constexpr (std::is_same_v<T, float>)
+                dstp[x] = static_cast<uint8_t>(std::clamp(std::lrint(srcp[x] * 255.0f + (chroma ? 128.0f : 0.0f)), 0L, 255L));
+            else
+                dstp[x] = srcp[x] >> (bits - 8);
+        }
+
+        dstp += dst_pitch;
+        srcp += src_pitch;
+    }
+}
+
+// 64-bit hash of a row. Four independent lanes let the multiplies overlap.
+static uint64_t hash_row(const uint8_t* r, int width) noexcept
+{
+    constexpr uint64_t k{ 0x9e3779b97f4a7c15ull };
+    uint64_t h[4]{ 1, 2, 3, 4 };
 
-            d += dst_pitch;
-            s += src_pitch;
-            su += src_pitch;
-            sd += src_pitch;
+    auto mix{ [](uint64_t h, uint64_t w) { h = (h ^ w) * k; return (h << 29) | (h >> 35); } };
+
+    int x{ 0 };
+
+    for (; x + 32 <= width; x += 32)
+    {
+        for (int i{ 0 }; i < 4; ++i)
+        {
+            uint64_t w;
+            memcpy(&w, r + x + 8 * i, 8);
+            h[i] = mix(h[i], w);
         }
+    }
+
+    for (; x < width; x += 8)
+    {
+        uint64_t w{ 0 };
+        memcpy(&w, r + x, std::min(width - x, 8));
+        h[0] = mix(h[0], w);
+    }
+
+    uint64_t hash{ h[0] ^ mix(h[1], h[2]) ^ mix(h[3], static_cast<uint64_t>(width)) };
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+// Index of the first byte that differs in a and b, limit if there is none before it.
+static int first_difference(const uint8_t* a, const uint8_t* b, int limit) noexcept
+{
+    int x{ 0 };
+
+    for (; x + 8 <= limit; x += 8)
+    {
+        uint64_t u, v;
+        memcpy(&u, a + x, 8);
+        memcpy(&v, b + x, 8);
+        if (u != v)
+            break;
+    }
+
+    while (x < limit && a[x] == b[x])
+        ++x;
+
+    return x;
+}
+
+// One past the index of the last byte that differs in a and b, start if there is none from start on.
+static int last_difference(const uint8_t* a, const uint8_t* b, int start, int end) noexcept
+{
+    int x{ end };
 
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
+    for (; x - 8 >= start; x -= 8)
+    {
+        uint64_t u, v;
+        memcpy(&u, a + x - 8, 8);
+        memcpy(&v, b + x - 8, 8);
+        if (u != v)
+            break;
     }
-    else if constexpr (std::is_same_v<T, uint16_t>)
+
+    while (x > start && a[x - 1] == b[x - 1])
+        --x;
+
+    return x;
+}
+
+// Bars of a plane: the rows at the top and the bottom equal to the first and the last row, and the columns at the left
+// and the right that don't change between the rows in between. A pixel with an equal neighbour above or below has a
+// mask of 0, so leaving the bars out doesn't change the mask. Returns the area without the bars.
+static Area find_bars(const uint8_t* p, int pitch, int row_size, int height, int size) noexcept
+{
+    auto row{ [=](int y) { return p + static_cast<int64_t>(y) * pitch; } };
+
+    int y0{ 1 };
+    while (y0 < height && !memcmp(row(y0), row(0), row_size))
+        ++y0;
+
+    int y1{ height - 1 };
+    while (y1 > y0 && !memcmp(row(y1 - 1), row(height - 1), row_size))
+        --y1;
+
+    // The mask of the rows y0..y1-1 reads the rows y0-1..y1.
+    const int first{ std::max(y0 - 1, 0) };
+    const int last{ std::min(y1, height - 1) };
+    int left{ row_size };
+    int right{ 0 };
+
+    for (int y{ first + 1 }; y <= last && (left > 0 || right < row_size); ++y)
     {
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
+        left = first_difference(row(y), row(first), left);
+        right = last_difference(row(y), row(first), right, row_size);
+    }
 
-        for (int y{ 1 }; y < height - 1; ++y)
-        {
-            for (int x{ 0 }; x < width; ++x)
-            {
-                const int prod{ ((su[x] - s[x]) * (sd[x] - s[x])) >> (bits - 8) };
-
-                if (prod < thresinf)
-                    d[x] = 0;
-                else if (prod > thressup)
-                    d[x] = peak;
-                else
-                    d[x] = prod >> 8;
-            }
+    return { left / size, (right + size - 1) / size, y0, y1 };
+}
+
+// Number of the rows 0..rows-1 of a plane that belong to the given field when every step-th row is one field.
+static inline int field_rows(int rows, int field, int step) noexcept
+{
+    return std::max(rows - field + step - 1, 0) / step;
+}
+
+template <typename T, int peak, int bits>
+void CombMask::set_kernels(int opt, int iset) noexcept
+{
+    if ((opt == -1 && iset >= 10) || opt == 3)
+    {
+        CM = (outbits == 8) ? CM_AVX512<T, peak, bits, uint8_t> : CM_AVX512<T, peak, bits>;
+        CMS = CMS_AVX512<T, peak, bits>;
+        CMP = CMP_AVX512<T, peak, bits>;
 
-            d += dst_pitch;
-            s += src_pitch;
-            su += src_pitch;
-            sd += src_pitch;
+        if (metric == 1)
+        {
+            CM = CM5_AVX512<T, peak, bits>;
+            CMS = CMS5_AVX512<T, peak, bits>;
         }
+    }
+    else if ((opt == -1 && iset >= 8) || opt == 2)
+    {
+        CM = (outbits == 8) ? CM_AVX2<T, peak, bits, uint8_t> : CM_AVX2<T, peak, bits>;
+        CMS = CMS_AVX2<T, peak, bits>;
+        CMP = CMP_AVX2<T, peak, bits>;
 
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
+        if (metric == 1)
+        {
+            CM = CM5_AVX2<T, peak, bits>;
+            CMS = CMS5_AVX2<T, peak, bits>;
+        }
     }
-    else
+    else if ((opt == -1 && iset >= 5) || opt == 4 || opt == 5)
     {
-        const float threshinf_{ thresinf / 255.0f };
-        const float thressup_{ thressup / 255.0f };
+        CM = (outbits == 8) ? CM_SSE2<T, peak, bits, uint8_t> : CM_SSE2<T, peak, bits>;
+        CMS = CMS_SSE2<T, peak, bits>;
+        CMP = CMP_SSE2<T, peak, bits>;
 
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
+        // SSE4.1 has a mask kernel only for 16-bit clips and AVX only for float clips.
+        if constexpr (std::is_same_v<T, uint16_t>)
+            CM = (outbits == 8) ? CM_SSE41<T, peak, bits, uint8_t> : CM_SSE41<T, peak, bits>;
+        else if constexpr (std::is_same_v<T, float>)
+        {
+            if ((opt == -1 && iset >= 7) || opt == 5)
+                CM = (outbits == 8) ? CM_AVX<T, peak, bits, uint8_t> : CM_AVX<T, peak, bits>;
+        }
 
-        for (int y{ 1 }; y < height - 1; ++y)
+        if (metric == 1)
         {
-            for (int x{ 0 }; x < width; ++x)
-            {
-                const float prod{ ((su[x] - s[x]) * (sd[x] - s[x])) * 255.0f };
-
-                if (prod < threshinf_)
-                    d[x] = 0.0f;
-                else if (prod > thressup_)
-                    d[x] = 1.0f;
-                else
-                    d[x] = prod / 255.0f;
-            }
+            CM = CM5_SSE2<T, peak, bits>;
+            CMS = CMS5_SSE2<T, peak, bits>;
+        }
+    }
+    else if ((opt == -1 && iset >= 2) || opt == 1)
+    {
+        CM = (outbits == 8) ? CM_SSE2<T, peak, bits, uint8_t> : CM_SSE2<T, peak, bits>;
+        CMS = CMS_SSE2<T, peak, bits>;
+        CMP = CMP_SSE2<T, peak, bits>;
 
-            d += dst_pitch;
-            s += src_pitch;
-            su += src_pitch;
-            sd += src_pitch;
+        if (metric == 1)
+        {
+            CM = CM5_SSE2<T, peak, bits>;
+            CMS = CMS5_SSE2<T, peak, bits>;
         }
+    }
+    else
+    {
+        CM = (outbits == 8) ? CM_C<T, peak, bits, uint8_t> : CM_C<T, peak, bits>;
+        CMS = CMS_C<T, peak, bits>;
+        CMP = CMP_C<T, peak, bits>;
 
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
+        if (metric == 1)
+        {
+            CM = CM5_C<T, peak, bits>;
+            CMS = CMS5_C<T, peak, bits>;
+        }
     }
 }
 
-CombMask::CombMask(PClip _child, int thY1, int thY2, int y, int u, int v, int opt, IScriptEnvironment* env) :
-    GenericVideoFilter(_child), Yth1(thY1), Yth2(thY2), Y(y), U(u), V(v)
+CombMask::CombMask(PClip _child, int thY1, int thY2, int y, int u, int v, int opt, int _threads, bool _metrics, int _cutoff, bool _mic, int _blockx, int _blocky, bool _packed, bool _luma, int _outbits, bool _inplace, const char* _cache, int framecache, bool _dedup, bool _progressive, const char* _matched, int left, int top, int right, int bottom, bool _autobars, bool _fields, bool _candidates, int _metric, IScriptEnvironment* env) :
+    GenericVideoFilter(_child), Yth1(thY1), Yth2(thY2), Y(y), U(u), V(v), threads(_threads), metrics(_metrics), cutoff(_cutoff), mic(_mic), blockx(_blockx), blocky(_blocky), packed(_packed), luma(_luma), outbits(_outbits), inplace(_inplace), dedup(_dedup), progressive(_progressive), matched(_matched), autobars(_autobars), fields(_fields), candidates(_candidates), metric(_metric)
 {
     has_at_least_v8 = env->FunctionExists("propShow");
 
+    has_at_least_v9 = true;
+    try { env->CheckVersion(9); }
+    catch (const AvisynthError&) { has_at_least_v9 = false; }
+
     if (vi.IsRGB() || !vi.IsPlanar())
         env->ThrowError("CombMask: clip must be in YUV planar format.");
     if (Y > 3 || Y < 1)
@@ -139,16 +255,87 @@ CombMask::CombMask(PClip _child, int thY1, int thY2, int y, int u, int v, int op
         env->ThrowError("CombMask: second luma threshold not in the range 0..255.");
     if (thY1 > thY2)
         env->ThrowError("CombMask: the first threshold should not be superior to the second one.");
-    if (opt < -1 || opt > 3)
-        env->ThrowError("CombMask: opt must be between -1..3.");
+    if (opt < -1 || opt > 5)
+        env->ThrowError("CombMask: opt must be between -1..5.");
+    if (threads < 0)
+        env->ThrowError("CombMask: threads must be greater than or equal to 0.");
+    if (cutoff < 0)
+        env->ThrowError("CombMask: cutoff must be greater than or equal to 0.");
+    if (metrics && !has_at_least_v8)
+        env->ThrowError("CombMask: metrics=true requires frame properties support (AviSynth+ 3.6 or later).");
+    if (cutoff > 0 && !has_at_least_v8)
+        env->ThrowError("CombMask: cutoff requires frame properties support (AviSynth+ 3.6 or later).");
+    if (mic && !metrics)
+        env->ThrowError("CombMask: mic=true requires metrics=true.");
+    if (mic && Y != 3)
+        env->ThrowError("CombMask: mic=true requires y=3.");
+    if (blockx < 4 || blockx > 2048 || (blockx & (blockx - 1)))
+        env->ThrowError("CombMask: blockx must be a power of 2 between 4..2048.");
+    if (blocky < 4 || blocky > 2048 || (blocky & (blocky - 1)))
+        env->ThrowError("CombMask: blocky must be a power of 2 between 4..2048.");
+    if (packed && thY1 != thY2)
+        env->ThrowError("CombMask: packed=true requires thY1 == thY2.");
+    if (packed && (metrics || cutoff > 0))
+        env->ThrowError("CombMask: packed=true can't be used together with metrics or cutoff.");
+    if (packed && !has_at_least_v8)
+        env->ThrowError("CombMask: packed=true requires frame properties support (AviSynth+ 3.6 or later).");
+    if (luma && (metrics || cutoff > 0 || packed))
+        env->ThrowError("CombMask: luma=true can't be used together with metrics, cutoff or packed.");
+
+    if (outbits == -1)
+        outbits = vi.BitsPerComponent();
+    if (outbits != 8 && outbits != vi.BitsPerComponent())
+        env->ThrowError("CombMask: outbits must be 8 or the bit depth of the clip.");
+    if (outbits == 8 && vi.BitsPerComponent() != 8 && (metrics || cutoff > 0 || packed || candidates))
+        env->ThrowError("CombMask: outbits=8 can't be used together with metrics, cutoff, packed or candidates.");
+    if (metric == 1 && outbits != vi.BitsPerComponent())
+        env->ThrowError("CombMask: metric=1 can't be used together with outbits=8.");
+    if (inplace && (metrics || cutoff > 0 || packed || luma || outbits != vi.BitsPerComponent()))
+        env->ThrowError("CombMask: inplace=true can't be used together with metrics, cutoff, packed, luma or outbits=8.");
+    if (*_cache && !metrics && cutoff == 0)
+        env->ThrowError("CombMask: cache requires metrics=true or cutoff.");
+    if (framecache < 0)
+        env->ThrowError("CombMask: framecache must be greater than or equal to 0.");
+    if (dedup && (metrics || cutoff > 0 || packed))
+        env->ThrowError("CombMask: dedup=true can't be used together with metrics, cutoff or packed.");
+    if ((progressive || !matched.empty()) && !has_at_least_v8)
+        env->ThrowError("CombMask: progressive and matched require frame properties support (AviSynth+ 3.6 or later).");
+    if (left < 0 || top < 0 || right < 0 || bottom < 0)
+        env->ThrowError("CombMask: left, top, right and bottom must be greater than or equal to 0.");
+    if (left + right >= vi.width || top + bottom >= vi.height)
+        env->ThrowError("CombMask: left, top, right and bottom leave no area.");
+    if (fields && mic)
+        env->ThrowError("CombMask: fields=true can't be used together with mic.");
+    if (candidates && !has_at_least_v8)
+        env->ThrowError("CombMask: candidates=true requires frame properties support (AviSynth+ 3.6 or later).");
+    if (candidates && (packed || luma || inplace || dedup || fields))
+        env->ThrowError("CombMask: candidates=true can't be used together with packed, luma, inplace, dedup or fields.");
+    if (metric < 0 || metric > 1)
+        env->ThrowError("CombMask: metric must be 0 or 1.");
+    if (metric == 1 && (packed || inplace || candidates))
+        env->ThrowError("CombMask: metric=1 can't be used together with packed, inplace or candidates.");
+
+    reach = (metric == 1) ? 2 : 1;
 
     const int iset{ instrset_detect() };
     if (opt == 1 && iset < 2)
-        env->ThrowError("tcolormask: opt=1 requires SSE2.");
+        env->ThrowError("CombMask: opt=1 requires SSE2.");
     if (opt == 2 && iset < 8)
-        env->ThrowError("tcolormask: opt=2 requires AVX2.");
+        env->ThrowError("CombMask: opt=2 requires AVX2.");
     if (opt == 3 && iset < 10)
-        env->ThrowError("tcolormask: opt=3 requires AVX512F.");
+        env->ThrowError("CombMask: opt=3 requires AVX512F.");
+    if (opt == 4 && iset < 5)
+        env->ThrowError("CombMask: opt=4 requires SSE4.1.");
+    if (opt == 5 && iset < 7)
+        env->ThrowError("CombMask: opt=5 requires AVX.");
+
+    if (threads == 0)
+        threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+    pool = std::make_unique<ThreadPool>(threads);
+
+    if (framecache > 0)
+        frames = std::make_unique<FrameCache>(static_cast<size_t>(framecache) << 20);
 
     const int planes[3]{ y, u, v };
     const int planecount{ std::min(vi.NumComponents(), 3) };
@@ -160,23 +347,18 @@ CombMask::CombMask(PClip _child, int thY1, int thY2, int y, int u, int v, int op
             case 2: proccesplanes[i] = 2; break;
             default: proccesplanes[i] = 1;
         }
+
+        const int ssw{ (i > 0) ? vi.GetPlaneWidthSubsampling(PLANAR_U) : 0 };
+        const int ssh{ (i > 0) ? vi.GetPlaneHeightSubsampling(PLANAR_U) : 0 };
+        margins[i][0] = left >> ssw;
+        margins[i][1] = top >> ssh;
+        margins[i][2] = right >> ssw;
+        margins[i][3] = bottom >> ssh;
     }
 
     switch (vi.ComponentSize())
     {
-        case 1:
-        {
-            if ((opt == -1 && iset >= 10) || opt == 3)
-                CM = CM_AVX512<uint8_t, 255, 8>;
-            else if ((opt == -1 && iset >= 8) || opt == 2)
-                CM = CM_AVX2<uint8_t, 255, 8>;
-            else if ((opt == -1 && iset >= 2) || opt == 1)
-                CM = CM_SSE2<uint8_t, 255, 8>;
-            else
-                CM = CM_C<uint8_t, 255, 8>;
-
-            break;
-        }
+        case 1: set_kernels<uint8_t, 255, 8>(opt, iset); break;
         case 2:
         {
             const int scale{ static_cast<int>(((1 << vi.BitsPerComponent()) - 1) / 255.0 + 0.5) };
@@ -185,106 +367,998 @@ CombMask::CombMask(PClip _child, int thY1, int thY2, int y, int u, int v, int op
 
             switch (vi.BitsPerComponent())
             {
-                case 10:
-                {
-                    if ((opt == -1 && iset >= 10) || opt == 3)
-                        CM = CM_AVX512<uint16_t, 1023, 10>;
-                    else if ((opt == -1 && iset >= 8) || opt == 2)
-                        CM = CM_AVX2<uint16_t, 1023, 10>;
-                    else if ((opt == -1 && iset >= 2) || opt == 1)
-                        CM = CM_SSE2<uint16_t, 1023, 10>;
-                    else
-                        CM = CM_C<uint16_t, 1023, 10>;
+                case 10: set_kernels<uint16_t, 1023, 10>(opt, iset); break;
+                case 12: set_kernels<uint16_t, 4095, 12>(opt, iset); break;
+                case 14: set_kernels<uint16_t, 16383, 14>(opt, iset); break;
+                default: set_kernels<uint16_t, 65535, 16>(opt, iset);
+            }
+            break;
+        }
+        default: set_kernels<float, 1, 32>(opt, iset);
+    }
 
-                    break;
-                }
-                case 12:
-                {
-                    if ((opt == -1 && iset >= 10) || opt == 3)
-                        CM = CM_AVX512<uint16_t, 4095, 12>;
-                    else if ((opt == -1 && iset >= 8) || opt == 2)
-                        CM = CM_AVX2<uint16_t, 4095, 12>;
-                    else if ((opt == -1 && iset >= 2) || opt == 1)
-                        CM = CM_SSE2<uint16_t, 4095, 12>;
-                    else
-                        CM = CM_C<uint16_t, 4095, 12>;
+    convert = nullptr;
 
-                    break;
-                }
-                case 14:
-                {
-                    if ((opt == -1 && iset >= 10) || opt == 3)
-                        CM = CM_AVX512<uint16_t, 16383, 14>;
-                    else if ((opt == -1 && iset >= 8) || opt == 2)
-                        CM = CM_AVX2<uint16_t, 16383, 14>;
-                    else if ((opt == -1 && iset >= 2) || opt == 1)
-                        CM = CM_SSE2<uint16_t, 16383, 14>;
-                    else
-                        CM = CM_C<uint16_t, 16383, 14>;
+    if (outbits != vi.BitsPerComponent())
+    {
+        switch (vi.BitsPerComponent())
+        {
+            case 10: convert = convert_to_8bit<uint16_t, 10>; break;
+            case 12: convert = convert_to_8bit<uint16_t, 12>; break;
+            case 14: convert = convert_to_8bit<uint16_t, 14>; break;
+            case 16: convert = convert_to_8bit<uint16_t, 16>; break;
+            default: convert = convert_to_8bit<float, 32>;
+        }
 
-                    break;
-                }
-                default:
+        vi.pixel_type = (vi.pixel_type & ~VideoInfo::CS_Sample_Bits_Mask) | VideoInfo::CS_Sample_Bits_8;
+    }
+
+    if (*_cache)
+    {
+        // The key covers the clip format and everything the metrics depend on. The content of the clip isn't hashed,
+        // every source needs its own file.
+        const auto margin{ [&](int p, int side) -> int64_t { return (planecount > p) ? margins[p][side] : 0; } };
+        const int64_t values[]{ vi.width, vi.height, vi.pixel_type, vi.num_frames, Yth1, Yth2, proccesplanes[0],
+            (planecount > 1) ? proccesplanes[1] : 0, (planecount > 2) ? proccesplanes[2] : 0, cutoff, mic, blockx, blocky, fields, metric,
+            margin(0, 0), margin(0, 1), margin(0, 2), margin(0, 3), margin(1, 0), margin(1, 1), margin(1, 2), margin(1, 3),
+            margin(2, 0), margin(2, 1), margin(2, 2), margin(2, 3) };
+
+        uint64_t key{ 14695981039346656037ull };
+        for (const int64_t value : values)
+        {
+            for (int b{ 0 }; b < 64; b += 8)
+            {
+                key ^= static_cast<uint64_t>(value >> b) & 0xff;
+                key *= 1099511628211ull;
+            }
+        }
+
+        try
+        {
+            cache = std::make_unique<MetricsCache>(_cache, vi.num_frames, key);
+        }
+        catch (const std::exception& e)
+        {
+            env->ThrowError("CombMask: %s", e.what());
+        }
+    }
+
+    // Only the luma plane is returned, so the chroma planes aren't allocated at all.
+    if (luma && !vi.IsY())
+    {
+        switch (vi.BitsPerComponent())
+        {
+            case 8: vi.pixel_type = VideoInfo::CS_Y8; break;
+            case 10: vi.pixel_type = VideoInfo::CS_Y10; break;
+            case 12: vi.pixel_type = VideoInfo::CS_Y12; break;
+            case 14: vi.pixel_type = VideoInfo::CS_Y14; break;
+            case 16: vi.pixel_type = VideoInfo::CS_Y16; break;
+            default: vi.pixel_type = VideoInfo::CS_Y32;
+        }
+    }
+}
+
+// Number of horizontal stripes a plane with the given number of inner rows is split in.
+int CombMask::stripes(int rows) const noexcept
+{
+    return std::max(std::min(threads, rows / 16), 1);
+}
+
+Area CombMask::area(int plane, int pixels, int height) const noexcept
+{
+    return { margins[plane][0], pixels - margins[plane][2], margins[plane][1], height - margins[plane][3] };
+}
+
+// The area of a plane of src that is scanned. With autobars the bars of this frame are left out as well.
+Area CombMask::scan_area(const PVideoFrame& src, int plane) const noexcept
+{
+    const int planes_y[3]{ PLANAR_Y, PLANAR_U, PLANAR_V };
+    const int size{ child->GetVideoInfo().ComponentSize() };
+    const int row_size{ src->GetRowSize(planes_y[plane]) };
+    const int height{ src->GetHeight(planes_y[plane]) };
+
+    Area a{ area(plane, row_size / size, height) };
+
+    if (autobars)
+    {
+        const Area b{ find_bars(src->GetReadPtr(planes_y[plane]), src->GetPitch(planes_y[plane]), row_size, height, size) };
+
+        a.x0 = std::max(a.x0, b.x0);
+        a.x1 = std::max(std::min(a.x1, b.x1), a.x0);
+        a.y0 = std::max(a.y0, b.y0);
+        a.y1 = std::max(std::min(a.y1, b.y1), a.y0);
+    }
+
+    return a;
+}
+
+// Writes the mask of the rows y0..y1-1 of a plane over the source rows. The kernel reads the original rows around
+// every output row, so they are copied a band at a time to a small buffer, carrying the last two rows of a band over
+// to the next one. The rows above and below the stripe belong to its neighbours and were saved before any stripe ran.
+void CombMask::inplace_stripe(uint8_t* dstp, int pitch, int width, int y0, int y1, const uint8_t* above, const uint8_t* below) const noexcept
+{
+    constexpr int band{ 16 };
+    const int buf_pitch{ (width + 63) & ~63 };
+    std::vector<uint8_t> buf(static_cast<size_t>(band + 2) * buf_pitch);
+
+    // Row i of the buffer is the source row y - 1 + i.
+    memcpy(buf.data(), above, width);
+    int filled{ 1 };
+
+    for (int y{ y0 }; y < y1; y += band)
+    {
+        const int rows{ std::min(band, y1 - y) };
+
+        for (int i{ filled }; i < rows + 2; ++i)
+        {
+            const int row{ y - 1 + i };
+            memcpy(buf.data() + static_cast<size_t>(i) * buf_pitch, (row == y1) ? below : dstp + static_cast<int64_t>(row) * pitch, width);
+        }
+
+        CM(dstp + static_cast<int64_t>(y) * pitch, buf.data() + buf_pitch, pitch, buf_pitch, rows, width, Yth1, Yth2);
+
+        memmove(buf.data(), buf.data() + static_cast<size_t>(rows) * buf_pitch, 2 * static_cast<size_t>(buf_pitch));
+        filled = 2;
+    }
+}
+
+PVideoFrame CombMask::GetMetrics(int n, PVideoFrame& src, IScriptEnvironment* env)
+{
+    // Without metrics only _Combed is needed, so the scan stops as soon as a plane has more than cutoff pixels above thY2.
+    const bool early_exit{ !metrics };
+
+    FrameMetrics m{};
+    m.state = early_exit ? 1 : 2;
+
+    // A cached record with all metrics also answers cutoff alone.
+    if (cache && cache->read(n, m.state, m))
+        return PutMetrics(src, m, env);
+
+    const int planes_y[3]{ PLANAR_Y, PLANAR_U, PLANAR_V };
+    const int planecount{ std::min(vi.NumComponents(), 3) };
+    // With fields every plane is scanned as two planes of every other row.
+    const int step{ fields ? 2 : 1 };
+
+    // The planes are scanned in row bands. For mic the luma bands are half a block high, otherwise they are 16 rows.
+    int band[3]{};
+    int bands[3]{};
+    for (int i{ 0 }; i < planecount; ++i)
+    {
+        band[i] = (mic && i == 0) ? blocky / 2 : 16;
+        bands[i] = (src->GetHeight(planes_y[i]) + band[i] - 1) / band[i];
+    }
+
+    // One CombStats per stripe, first[i * step + f] is the first stripe of the field f of the plane i.
+    int first[7]{};
+    for (int i{ 0 }; i < planecount; ++i)
+    {
+        for (int f{ 0 }; f < step; ++f)
+        {
+            const int height{ field_rows(src->GetHeight(planes_y[i]), f, step) };
+            const int v{ i * step + f };
+            first[v + 1] = first[v] + ((proccesplanes[i] == 3) ? std::min(stripes(height - 2 * reach), (height + band[i] - 1) / band[i]) : 0);
+        }
+    }
+
+    std::vector<CombStats> stats(first[planecount * step], CombStats{ 0, 0.0 });
+    std::vector<std::function<void()>> jobs;
+
+    std::atomic<int64_t> plane_combed[3]{};
+    std::atomic<bool> is_combed{ false };
+
+    // mic: number of pixels above thY2 in every luma cell of blockx/2 x blocky/2 pixels.
+    // There is one zero cell more on the right and at the bottom, so every cell can start a block of 2x2 cells.
+    const int cell_w{ blockx / 2 };
+    const int cells_x{ mic ? (src->GetRowSize(PLANAR_Y) / vi.ComponentSize() + cell_w - 1) / cell_w : 0 };
+    std::vector<int> cells(mic ? static_cast<size_t>(bands[0] + 1) * (cells_x + 1) : 0);
+
+    for (int i{ 0 }; i < planecount; ++i)
+    {
+        if (proccesplanes[i] != 3)
+            continue;
+
+        const int width{ src->GetRowSize(planes_y[i]) };
+        const Area a{ scan_area(src, i) };
+        const int band_h{ band[i] };
+        const bool block_sums{ mic && i == 0 };
+        std::atomic<int64_t>* combed{ &plane_combed[i] };
+
+        for (int f{ 0 }; f < step; ++f)
+        {
+            const int v{ i * step + f };
+            const int src_pitch{ src->GetPitch(planes_y[i]) * step };
+            const int height{ field_rows(src->GetHeight(planes_y[i]), f, step) };
+            const uint8_t* srcp{ src->GetReadPtr(planes_y[i]) + f * src->GetPitch(planes_y[i]) + a.x0 * vi.ComponentSize() };
+            const int area_y0{ field_rows(a.y0, f, step) };
+            const int area_y1{ field_rows(a.y1, f, step) };
+            const int view_bands{ (height + band_h - 1) / band_h };
+            const int count{ first[v + 1] - first[v] };
+
+            for (int j{ 0 }; j < count; ++j)
+            {
+                const int b0{ static_cast<int>(static_cast<int64_t>(view_bands) * j / count) };
+                const int b1{ static_cast<int>(static_cast<int64_t>(view_bands) * (j + 1) / count) };
+                CombStats* st{ &stats[first[v] + j] };
+
+                jobs.emplace_back([=, &is_combed, &cells]
+                    {
+                        const int pixels{ width / vi.ComponentSize() };
+                        const int area_width{ (a.x1 - a.x0) * vi.ComponentSize() };
+                        // The columns outside the area stay 0.
+                        std::vector<uint16_t> colsum(block_sums ? pixels + 64 : 0);
+
+                        for (int b{ b0 }; b < b1 && !(early_exit && is_combed.load(std::memory_order_relaxed)); ++b)
+                        {
+                            // The first and the last rows of the plane or field have no neighbours and aren't checked.
+                            const int y0{ std::max({ b * band_h, reach, area_y0 }) };
+                            const int y1{ std::min({ (b + 1) * band_h, height - reach, area_y1 }) };
+                            if (y1 <= y0)
+                                continue;
+
+                            const int64_t before{ st->combed };
+                            const uint8_t* row{ srcp + static_cast<int64_t>(y0) * src_pitch };
+
+                            CMS(row, row, src_pitch, y1 - y0, area_width, Yth1, Yth2, block_sums ? colsum.data() + a.x0 : nullptr, *st);
+
+                            if (early_exit && (*combed += st->combed - before) > cutoff)
+                                is_combed = true;
+
+                            if (block_sums)
+                            {
+                                int* cell{ &cells[static_cast<size_t>(b) * (cells_x + 1)] };
+                                for (int c{ 0 }; c < cells_x; ++c)
+                                {
+                                    const int x1{ std::min((c + 1) * cell_w, pixels) };
+                                    for (int x{ c * cell_w }; x < x1; ++x)
+                                        cell[c] += colsum[x];
+                                }
+                            }
+                        }
+                    });
+            }
+        }
+    }
+
+    pool->run(jobs);
+
+    if (early_exit)
+        m.is_combed = is_combed;
+    else
+    {
+        const double peak{ (vi.ComponentSize() == 4) ? 1.0 : static_cast<double>((1 << vi.BitsPerComponent()) - 1) };
+
+        for (int i{ 0 }; i < planecount; ++i)
+        {
+            if (proccesplanes[i] != 3)
+                continue;
+
+            CombStats total{ 0, 0.0 };
+            for (int j{ first[i * step] }; j < first[(i + 1) * step]; ++j)
+            {
+                total.combed += stats[j].combed;
+                total.sum += stats[j].sum;
+            }
+
+            const Area a{ area(i, src->GetRowSize(planes_y[i]) / vi.ComponentSize(), src->GetHeight(planes_y[i])) };
+            const double pixels{ static_cast<double>(a.x1 - a.x0) * (a.y1 - a.y0) };
+
+            m.combed[i] = total.combed;
+            m.mean[i] = total.sum * 255.0 / (peak * pixels);
+
+            if (cutoff > 0 && total.combed > cutoff)
+                m.is_combed = 1;
+        }
+
+        if (mic)
+        {
+            // Blocks of blockx x blocky pixels overlapping by half a block in both directions.
+            int max_combed{ -1 };
+            int max_x{ 0 };
+            int max_y{ 0 };
+
+            for (int y{ 0 }; y < bands[0]; ++y)
+            {
+                const int* cell{ &cells[static_cast<size_t>(y) * (cells_x + 1)] };
+
+                for (int x{ 0 }; x < cells_x; ++x)
                 {
-                    if ((opt == -1 && iset >= 10) || opt == 3)
-                        CM = CM_AVX512<uint16_t, 65535, 16>;
-                    else if ((opt == -1 && iset >= 8) || opt == 2)
-                        CM = CM_AVX2<uint16_t, 65535, 16>;
-                    else if ((opt == -1 && iset >= 2) || opt == 1)
-                        CM = CM_SSE2<uint16_t, 65535, 16>;
-                    else
-                        CM = CM_C<uint16_t, 65535, 16>;
+                    const int block{ cell[x] + cell[x + 1] + cell[x + cells_x + 1] + cell[x + cells_x + 2] };
 
-                    break;
+                    if (block > max_combed)
+                    {
+                        max_combed = block;
+                        max_x = x;
+                        max_y = y;
+                    }
                 }
             }
-            break;
+
+            m.mic = max_combed;
+            m.mic_x = max_x * cell_w;
+            m.mic_y = max_y * (blocky / 2);
         }
-        default:
+    }
+
+    if (cache)
+        cache->write(n, m);
+
+    return PutMetrics(src, m, env);
+}
+
+PVideoFrame CombMask::PutMetrics(PVideoFrame& src, const FrameMetrics& m, IScriptEnvironment* env)
+{
+    if (has_at_least_v9)
+        env->MakePropertyWritable(&src);
+    else
+        env->MakeWritable(&src);
+
+    AVSMap* props{ env->getFramePropsRW(src) };
+
+    if (!metrics)
+    {
+        env->propSetInt(props, "_Combed", m.is_combed, 0);
+
+        return src;
+    }
+
+    const char* combed_names[3]{ "CombMaskCombedY", "CombMaskCombedU", "CombMaskCombedV" };
+    const char* mean_names[3]{ "CombMaskMeanY", "CombMaskMeanU", "CombMaskMeanV" };
+    const int planecount{ std::min(vi.NumComponents(), 3) };
+
+    for (int i{ 0 }; i < planecount; ++i)
+    {
+        if (proccesplanes[i] != 3)
+            continue;
+
+        env->propSetInt(props, combed_names[i], m.combed[i], 0);
+        env->propSetFloat(props, mean_names[i], m.mean[i], 0);
+    }
+
+    if (cutoff > 0)
+        env->propSetInt(props, "_Combed", m.is_combed, 0);
+
+    if (mic)
+    {
+        env->propSetInt(props, "CombMaskMIC", m.mic, 0);
+        env->propSetInt(props, "CombMaskMICX", m.mic_x, 0);
+        env->propSetInt(props, "CombMaskMICY", m.mic_y, 0);
+    }
+
+    return src;
+}
+
+PVideoFrame CombMask::GetPacked(PVideoFrame& src, bool skip, IScriptEnvironment* env)
+{
+    const int planes_y[3]{ PLANAR_Y, PLANAR_U, PLANAR_V };
+    const int planecount{ std::min(vi.NumComponents(), 3) };
+
+    std::vector<uint8_t> masks[3];
+    std::vector<std::function<void()>> jobs;
+
+    for (int i{ 0 }; i < planecount; ++i)
+    {
+        if (proccesplanes[i] != 3)
+            continue;
+
+        const int src_pitch{ src->GetPitch(planes_y[i]) };
+        const int height{ src->GetHeight(planes_y[i]) };
+        const int width{ src->GetRowSize(planes_y[i]) };
+        const uint8_t* srcp{ src->GetReadPtr(planes_y[i]) };
+        const int pitch{ packed_pitch(width / vi.ComponentSize()) };
+        const Area a{ scan_area(src, i) };
+
+        // The first and the last row of the plane or field and everything outside the area stay 0, a skipped frame is all 0.
+        masks[i].assign(static_cast<size_t>(pitch) * height, 0);
+
+        // The area starts at a whole byte, the bits of the columns before it are cleared afterwards.
+        const int x0{ a.x0 & ~7 };
+        const int lead{ a.x0 - x0 };
+        const int area_width{ (a.x1 - x0) * vi.ComponentSize() };
+        const int step{ fields ? 2 : 1 };
+
+        for (int f{ 0 }; f < step; ++f)
         {
-            if ((opt == -1 && iset >= 10) || opt == 3)
-                CM = CM_AVX512<float, 1, 32>;
-            else if ((opt == -1 && iset >= 8) || opt == 2)
-                CM = CM_AVX2<float, 1, 32>;
-            else if ((opt == -1 && iset >= 2) || opt == 1)
-                CM = CM_SSE2<float, 1, 32>;
-            else
-                CM = CM_C<float, 1, 32>;
+            uint8_t* dstp{ masks[i].data() + f * pitch + x0 / 8 };
+            const uint8_t* srcp_a{ srcp + f * src_pitch + x0 * vi.ComponentSize() };
+            const int pitch_f{ pitch * step };
+            const int src_pitch_f{ src_pitch * step };
+            const int height_f{ field_rows(height, f, step) };
+
+            const int first_row{ std::max(field_rows(a.y0, f, step), 1) };
+            const int rows{ std::max(std::min(field_rows(a.y1, f, step), height_f - 1) - first_row, 0) };
+            const int count{ skip ? 0 : stripes(rows) };
+
+            for (int j{ 0 }; j < count; ++j)
+            {
+                const int y0{ first_row + static_cast<int>(static_cast<int64_t>(rows) * j / count) };
+                const int y1{ first_row + static_cast<int>(static_cast<int64_t>(rows) * (j + 1) / count) };
+
+                jobs.emplace_back([this, dstp, srcp_a, pitch_f, src_pitch_f, area_width, lead, y0, y1]
+                    {
+                        CMP(dstp + static_cast<int64_t>(y0) * pitch_f, srcp_a + static_cast<int64_t>(y0) * src_pitch_f, pitch_f, src_pitch_f, y1 - y0, area_width, Yth2);
+
+                        if (lead > 0)
+                        {
+                            for (int y{ y0 }; y < y1; ++y)
+                                dstp[static_cast<int64_t>(y) * pitch_f] &= static_cast<uint8_t>(0xff << lead);
+                        }
+                    });
+            }
         }
     }
+
+    pool->run(jobs);
+
+    if (has_at_least_v9)
+        env->MakePropertyWritable(&src);
+    else
+        env->MakeWritable(&src);
+
+    AVSMap* props{ env->getFramePropsRW(src) };
+
+    for (int i{ 0 }; i < planecount; ++i)
+    {
+        if (!masks[i].empty())
+            env->propSetData(props, packed_names[i], reinterpret_cast<const char*>(masks[i].data()), static_cast<int>(masks[i].size()), 0);
+    }
+
+    return src;
 }
 
 PVideoFrame CombMask::GetFrame(int n, IScriptEnvironment* env)
+{
+    PVideoFrame frame;
+
+    if (frames && frames->get(n, frame))
+        return frame;
+
+    frame = MakeFrame(n, env);
+
+    if (frames)
+    {
+        const int planes[4]{ PLANAR_Y, PLANAR_U, PLANAR_V, PLANAR_A };
+        size_t bytes{ 0 };
+        for (int i{ 0 }; i < vi.NumComponents(); ++i)
+            bytes += static_cast<size_t>(frame->GetPitch(planes[i])) * frame->GetHeight(planes[i]);
+
+        frames->put(n, frame, bytes);
+    }
+
+    return frame;
+}
+
+// Hashes of every row of all planes of a frame, every plane is split in stripes hashed in parallel.
+void CombMask::RowHashes(const PVideoFrame& src, std::vector<uint64_t>* rows)
+{
+    const int planes[4]{ PLANAR_Y, PLANAR_U, PLANAR_V, PLANAR_A };
+    const int planecount{ child->GetVideoInfo().NumComponents() };
+
+    std::vector<std::function<void()>> jobs;
+
+    for (int i{ 0 }; i < planecount; ++i)
+    {
+        const uint8_t* srcp{ src->GetReadPtr(planes[i]) };
+        const int pitch{ src->GetPitch(planes[i]) };
+        const int width{ src->GetRowSize(planes[i]) };
+        const int height{ src->GetHeight(planes[i]) };
+        const int count{ stripes(height) };
+
+        rows[i].resize(height);
+        uint64_t* h{ rows[i].data() };
+
+        for (int j{ 0 }; j < count; ++j)
+        {
+            const int y0{ static_cast<int>(static_cast<int64_t>(height) * j / count) };
+            const int y1{ static_cast<int>(static_cast<int64_t>(height) * (j + 1) / count) };
+
+            jobs.emplace_back([=]
+                {
+                    for (int y{ y0 }; y < y1; ++y)
+                        h[y] = hash_row(srcp + static_cast<int64_t>(y) * pitch, width);
+                });
+        }
+    }
+
+    pool->run(jobs);
+}
+
+// Progressive (_FieldBased = 0) and already matched frames aren't expected to be combed.
+bool CombMask::Skip(const PVideoFrame& src, IScriptEnvironment* env) const
+{
+    const AVSMap* props{ env->getFramePropsRO(src) };
+    int err{ 0 };
+
+    if (progressive && env->propGetInt(props, "_FieldBased", 0, &err) == 0 && !err)
+        return true;
+
+    return !matched.empty() && env->propGetInt(props, matched.c_str(), 0, &err) != 0 && !err;
+}
+
+// The shared all-zero mask with the properties of src.
+PVideoFrame CombMask::GetZero(const PVideoFrame& src, IScriptEnvironment* env)
+{
+    const auto clear{ [&](PVideoFrame& frame) {
+        const int planes[3]{ PLANAR_Y, PLANAR_U, PLANAR_V };
+        for (int i{ 0 }; i < vi.NumComponents(); ++i)
+        {
+            uint8_t* dstp{ frame->GetWritePtr(planes[i]) };
+            const int pitch{ frame->GetPitch(planes[i]) };
+            const int row_size{ frame->GetRowSize(planes[i]) };
+
+            for (int y{ 0 }; y < frame->GetHeight(planes[i]); ++y)
+                memset(dstp + static_cast<int64_t>(y) * pitch, 0, row_size);
+        }
+    } };
+
+    // Without MakePropertyWritable (v9) the shared frame would be copied for its properties, a new one is cheaper.
+    if (!has_at_least_v9)
+    {
+        PVideoFrame frame{ env->NewVideoFrameP(vi, &src) };
+        clear(frame);
+
+        return frame;
+    }
+
+    PVideoFrame frame;
+
+    {
+        std::lock_guard<std::mutex> lock(zero_mtx);
+
+        if (!zero)
+        {
+            zero = env->NewVideoFrame(vi);
+            clear(zero);
+        }
+
+        frame = zero;
+    }
+
+    env->MakePropertyWritable(&frame);
+    env->copyFrameProps(src, frame);
+
+    return frame;
+}
+
+// Number of pixels above thY2 of the frames woven from the even rows (top field) of the current frame and the odd rows
+// (bottom field) of the previous, the current and the next frame. The kernels read the rows of both frames directly.
+PVideoFrame CombMask::GetCandidates(int n, PVideoFrame& src, bool skip, IScriptEnvironment* env)
+{
+    const int planes_y[3]{ PLANAR_Y, PLANAR_U, PLANAR_V };
+    const int planecount{ std::min(vi.NumComponents(), 3) };
+    const int size{ vi.ComponentSize() };
+
+    // p, c, n
+    PVideoFrame others[3];
+    if (!skip)
+    {
+        others[0] = child->GetFrame(std::max(n - 1, 0), env);
+        others[1] = src;
+        others[2] = child->GetFrame(std::min(n + 1, vi.num_frames - 1), env);
+    }
+
+    // Both frames are walked with one pitch, a plane of a neighbour with another pitch is copied.
+    std::vector<uint8_t> copies[3][3];
+    std::atomic<int64_t> combed[3]{};
+    std::vector<std::function<void()>> jobs;
+
+    for (int k{ 0 }; k < (skip ? 0 : 3); ++k)
+    {
+        for (int i{ 0 }; i < planecount; ++i)
+        {
+            if (proccesplanes[i] != 3)
+                continue;
+
+            const int pitch{ src->GetPitch(planes_y[i]) };
+            const int height{ src->GetHeight(planes_y[i]) };
+            const int width{ src->GetRowSize(planes_y[i]) };
+            const Area a{ area(i, width / size, height) };
+            const uint8_t* cur{ src->GetReadPtr(planes_y[i]) + a.x0 * size };
+            const uint8_t* alt{ others[k]->GetReadPtr(planes_y[i]) };
+
+            if (others[k]->GetPitch(planes_y[i]) != pitch)
+            {
+                copies[k][i].resize(static_cast<size_t>(pitch) * height);
+                env->BitBlt(copies[k][i].data(), pitch, alt, others[k]->GetPitch(planes_y[i]), width, height);
+                alt = copies[k][i].data();
+            }
+
+            alt += a.x0 * size;
+
+            const int area_width{ (a.x1 - a.x0) * size };
+            const int first_row{ std::max(a.y0, 1) };
+            const int rows{ std::max(std::min(a.y1, height - 1) - first_row, 0) };
+            const int count{ stripes(rows) };
+            std::atomic<int64_t>* total{ &combed[k] };
+
+            for (int j{ 0 }; j < count; ++j)
+            {
+                const int y0{ first_row + static_cast<int>(static_cast<int64_t>(rows) * j / count) };
+                const int y1{ first_row + static_cast<int>(static_cast<int64_t>(rows) * (j + 1) / count) };
+                const uint8_t* even{ cur + static_cast<int64_t>(y0) * pitch };
+                const uint8_t* odd{ alt + static_cast<int64_t>(y0) * pitch };
+
+                jobs.emplace_back([=]
+                    {
+                        CombStats st{ 0, 0.0 };
+                        CMS((y0 & 1) ? odd : even, (y0 & 1) ? even : odd, pitch, y1 - y0, area_width, Yth1, Yth2, nullptr, st);
+                        *total += st.combed;
+                    });
+            }
+        }
+    }
+
+    pool->run(jobs);
+
+    if (has_at_least_v9)
+        env->MakePropertyWritable(&src);
+    else
+        env->MakeWritable(&src);
+
+    AVSMap* props{ env->getFramePropsRW(src) };
+    env->propSetInt(props, "CombMaskMatchP", combed[0], 0);
+    env->propSetInt(props, "CombMaskMatchC", combed[1], 0);
+    env->propSetInt(props, "CombMaskMatchN", combed[2], 0);
+
+    return src;
+}
+
+PVideoFrame CombMask::MakeFrame(int n, IScriptEnvironment* env)
 {
     PVideoFrame	src{ child->GetFrame(n, env) };
-    PVideoFrame	dst{ has_at_least_v8 ? env->NewVideoFrameP(vi, &src) : env->NewVideoFrame(vi) };
+
+    const bool skip{ (progressive || !matched.empty()) && Skip(src, env) };
+
+    if (candidates)
+        src = GetCandidates(n, src, skip, env);
+
+    if (metrics || cutoff > 0)
+        return skip ? PutMetrics(src, FrameMetrics{}, env) : GetMetrics(n, src, env);
+
+    if (candidates)
+        return src;
+
+    if (packed)
+        return GetPacked(src, skip, env);
+
+    // Without planes copied from the source all skipped frames share one zero mask.
+    if (skip && std::none_of(proccesplanes, proccesplanes + std::min(vi.NumComponents(), 3), [](int mode) { return mode == 2; }) &&
+        vi.NumComponents() != 4)
+        return GetZero(src, env);
+
+    std::shared_ptr<LastFrame> next;
+    std::shared_ptr<const LastFrame> prev;
+
+    if (dedup && !skip)
+    {
+        next = std::make_shared<LastFrame>();
+        RowHashes(src, next->rows);
+
+        {
+            std::lock_guard<std::mutex> lock(last_mtx);
+            prev = last;
+        }
+
+        // A source frame equal to the last one gets its mask by reference, only with the properties of the new frame.
+        if (prev && std::equal(std::begin(next->rows), std::end(next->rows), std::begin(prev->rows)))
+        {
+            PVideoFrame frame{ prev->mask };
+
+            if (has_at_least_v9)
+                env->MakePropertyWritable(&frame);
+            else if (has_at_least_v8)
+                env->MakeWritable(&frame);
+
+            if (has_at_least_v8)
+                env->copyFrameProps(src, frame);
+
+            return frame;
+        }
+    }
+
+    // With inplace the mask is written over the source frame, which MakeWritable copies only if it's shared.
+    if (inplace)
+        env->MakeWritable(&src);
+
+    // Otherwise only the mask rows whose source row or its neighbours above and below changed are computed, the rest is
+    // copied from the last mask.
+    const bool partial{ prev && !inplace };
+    std::vector<uint8_t> dirty[3][2];
+
+    PVideoFrame	dst{ inplace ? PVideoFrame() : (has_at_least_v8 ? env->NewVideoFrameP(vi, &src) : env->NewVideoFrame(vi)) };
+    PVideoFrame& out{ inplace ? src : dst };
+
+    // All planes are independent, so the stripes of every plane and the plane copies are run as one batch.
+    std::vector<std::function<void()>> jobs;
+    // In place, the rows above and below every stripe, saved before any stripe overwrites them.
+    std::vector<uint8_t> edges[3][2];
 
     const int planes_y[3]{ PLANAR_Y, PLANAR_U, PLANAR_V };
     const int planecount{ std::min(vi.NumComponents(), 3) };
     for (int i{ 0 }; i < planecount; ++i)
     {
         const int src_pitch{ src->GetPitch(planes_y[i]) };
-        const int dst_pitch{ dst->GetPitch(planes_y[i]) };
+        const int dst_pitch{ out->GetPitch(planes_y[i]) };
         const int height{ src->GetHeight(planes_y[i]) };
         const int width{ src->GetRowSize(planes_y[i]) };
         const uint8_t* srcp{ src->GetReadPtr(planes_y[i]) };
-        uint8_t* __restrict dstp{ dst->GetWritePtr(planes_y[i]) };
+        uint8_t* dstp{ out->GetWritePtr(planes_y[i]) };
+
+        if (proccesplanes[i] == 3 && skip)
+        {
+            const int row_size{ out->GetRowSize(planes_y[i]) };
+
+            jobs.emplace_back([=]
+                {
+                    for (int y{ 0 }; y < height; ++y)
+                        memset(dstp + static_cast<int64_t>(y) * dst_pitch, 0, row_size);
+                });
+        }
+        else if (proccesplanes[i] == 3)
+        {
+            // Only the area is computed. Every byte offset and width below is of the area.
+            const int src_size{ child->GetVideoInfo().ComponentSize() };
+            const int pixels{ width / src_size };
+            const int dst_size{ out->GetRowSize(planes_y[i]) / pixels };
+            const Area a{ scan_area(src, i) };
+            const uint8_t* srcp_a{ srcp + a.x0 * src_size };
+            uint8_t* dstp_a{ dstp + a.x0 * dst_size };
+            const int width_a{ (a.x1 - a.x0) * src_size };
+            const int row_size{ (a.x1 - a.x0) * dst_size };
+
+            // With fields every other row is one field, computed as a plane of its own. Every pointer, pitch and row
+            // below is of the field.
+            const int step{ fields ? 2 : 1 };
+            int first_rows[2]{};
+            int last_rows[2]{};
+
+            for (int f{ 0 }; f < step; ++f)
+            {
+                const int src_pitch_f{ src_pitch * step };
+                const int dst_pitch_f{ dst_pitch * step };
+                const int height_f{ field_rows(height, f, step) };
+                const uint8_t* srcp_f{ srcp_a + f * src_pitch };
+                uint8_t* dstp_f{ dstp_a + f * dst_pitch };
+
+                // Split the inner rows of the area in horizontal stripes. Every stripe reads reach rows above and below itself.
+                const int first_row{ std::max(field_rows(a.y0, f, step), reach) };
+                const int last_row{ std::min(field_rows(a.y1, f, step), height_f - reach) };
+                const int rows{ std::max(last_row - first_row, 0) };
+                const int count{ stripes(rows) };
+                first_rows[f] = first_row;
+                last_rows[f] = last_row;
+
+                uint8_t* edge{ nullptr };
+                if (inplace)
+                {
+                    edges[i][f].resize(static_cast<size_t>(count) * 2 * width_a);
+                    edge = edges[i][f].data();
+                }
+
+                const uint8_t* prevp{ partial ? prev->mask->GetReadPtr(planes_y[i]) + f * prev->mask->GetPitch(planes_y[i]) + a.x0 * dst_size : nullptr };
+                const int prev_pitch{ partial ? prev->mask->GetPitch(planes_y[i]) * step : 0 };
+
+                if (partial)
+                {
+                    const uint64_t* now{ next->rows[i].data() };
+                    const uint64_t* before{ prev->rows[i].data() };
+
+                    // Row y of the field is the row y * step + f of the plane.
+                    dirty[i][f].resize(height_f);
+                    for (int y{ reach }; y < height_f - reach; ++y)
+                    {
+                        for (int k{ -reach }; k <= reach && !dirty[i][f][y]; ++k)
+                        {
+                            const int r{ (y + k) * step + f };
+                            dirty[i][f][y] = now[r] != before[r];
+                        }
+                    }
+                }
 
-        if (proccesplanes[i] == 3)
-            CM(dstp, srcp, dst_pitch, src_pitch, height, width, Yth1, Yth2);
-        else if (proccesplanes[i] == 2)
-            env->BitBlt(dstp, dst_pitch, srcp, src_pitch, width, height);
+                const uint8_t* d{ dirty[i][f].data() };
+
+                for (int j{ 0 }; j < count; ++j)
+                {
+                    const int y0{ first_row + static_cast<int>(static_cast<int64_t>(rows) * j / count) };
+                    const int y1{ first_row + static_cast<int>(static_cast<int64_t>(rows) * (j + 1) / count) };
+
+                    if (inplace)
+                    {
+                        uint8_t* above{ edge + static_cast<size_t>(j) * 2 * width_a };
+                        uint8_t* below{ above + width_a };
+                        memcpy(above, srcp_f + static_cast<int64_t>(y0 - 1) * src_pitch_f, width_a);
+                        memcpy(below, srcp_f + static_cast<int64_t>(y1) * src_pitch_f, width_a);
+
+                        jobs.emplace_back([this, dstp_f, dst_pitch_f, width_a, y0, y1, above, below]
+                            {
+                                inplace_stripe(dstp_f, dst_pitch_f, width_a, y0, y1, above, below);
+                            });
+                    }
+                    else if (partial)
+                        jobs.emplace_back([this, dstp_f, srcp_f, dst_pitch_f, src_pitch_f, width_a, y0, y1, d, prevp, prev_pitch, row_size]
+                            {
+                                for (int y{ y0 }; y < y1;)
+                                {
+                                    int y2{ y + 1 };
+                                    while (y2 < y1 && d[y2] == d[y])
+                                        ++y2;
+
+                                    if (d[y])
+                                        CM(dstp_f + static_cast<int64_t>(y) * dst_pitch_f, srcp_f + static_cast<int64_t>(y) * src_pitch_f, dst_pitch_f, src_pitch_f, y2 - y, width_a, Yth1, Yth2);
+                                    else
+                                    {
+                                        for (int r{ y }; r < y2; ++r)
+                                            memcpy(dstp_f + static_cast<int64_t>(r) * dst_pitch_f, prevp + static_cast<int64_t>(r) * prev_pitch, row_size);
+                                    }
+
+                                    y = y2;
+                                }
+                            });
+                    else
+                        jobs.emplace_back([this, dstp_f, srcp_f, dst_pitch_f, src_pitch_f, width_a, y0, y1]
+                            {
+                                CM(dstp_f + static_cast<int64_t>(y0) * dst_pitch_f, srcp_f + static_cast<int64_t>(y0) * src_pitch_f, dst_pitch_f, src_pitch_f, y1 - y0, width_a, Yth1, Yth2);
+                            });
+                }
+            }
+
+            // Outside of the inner rows of the area the mask is 0. In place, the stripes read only the columns of the
+            // area and their saved edges, so this can run next to them.
+            const int plane_row_size{ out->GetRowSize(planes_y[i]) };
+            const int left_size{ a.x0 * dst_size };
+            const int right_size{ plane_row_size - left_size - row_size };
+
+            jobs.emplace_back([=]
+                {
+                    for (int y{ 0 }; y < height; ++y)
+                    {
+                        uint8_t* row{ dstp + static_cast<int64_t>(y) * dst_pitch };
+                        const int f{ y % step };
+
+                        if (y / step < first_rows[f] || y / step >= last_rows[f])
+                            memset(row, 0, plane_row_size);
+                        else
+                        {
+                            memset(row, 0, left_size);
+                            memset(row + plane_row_size - right_size, 0, right_size);
+                        }
+                    }
+                });
+        }
+        else if (proccesplanes[i] == 2 && !inplace)
+        {
+            if (convert)
+                jobs.emplace_back([=] { convert(dstp, srcp, dst_pitch, src_pitch, width, height, i > 0); });
+            else
+                jobs.emplace_back([=] { env->BitBlt(dstp, dst_pitch, srcp, src_pitch, width, height); });
+        }
+    }
+
+    if (vi.NumComponents() == 4 && !inplace)
+    {
+        uint8_t* dstp{ dst->GetWritePtr(PLANAR_A) };
+        const uint8_t* srcp{ src->GetReadPtr(PLANAR_A) };
+        const int dst_pitch{ dst->GetPitch(PLANAR_A) };
+        const int src_pitch{ src->GetPitch(PLANAR_A) };
+        const int width{ src->GetRowSize(PLANAR_A) };
+        const int height{ src->GetHeight(PLANAR_A) };
+
+        if (convert)
+            jobs.emplace_back([=] { convert(dstp, srcp, dst_pitch, src_pitch, width, height, false); });
+        else
+            jobs.emplace_back([=] { env->BitBlt(dstp, dst_pitch, srcp, src_pitch, width, height); });
     }
 
-    if (vi.NumComponents() == 4)
-        env->BitBlt(dst->GetWritePtr(PLANAR_A), dst->GetPitch(PLANAR_A), src->GetReadPtr(PLANAR_A), src->GetPitch(PLANAR_A), src->GetRowSize(PLANAR_A), src->GetHeight(PLANAR_A));
+    pool->run(jobs);
+
+    if (next)
+    {
+        next->mask = out;
+
+        std::lock_guard<std::mutex> lock(last_mtx);
+        last = next;
+    }
+
+    return out;
+}
+
+template <typename T, int peak>
+static void unpack_c(uint8_t* __restrict dstp_, const uint8_t* srcp, int dst_pitch, int src_pitch, const int height, int width) noexcept
+{
+    // Every packed byte is expanded to 8 mask values with a single copy.
+    static const auto lut{ []
+        {
+            std::array<std::array<T, 8>, 256> table{};
+            for (int i{ 0 }; i < 256; ++i)
+            {
+                for (int j{ 0 }; j < 8; ++j)
+                    table[i][j] = ((i >> j) & 1) ? static_cast<T>(peak) : 0;
+            }
+
+            return table;
+        }() };
+
+    dst_pitch /= sizeof(T);
+    width /= sizeof(T);
+    T* __restrict dstp{ reinterpret_cast<T*>(dstp_) };
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        int x{ 0 };
+        for (; x + 8 <= width; x += 8)
+            memcpy(dstp + x, lut[srcp[x / 8]].data(), 8 * sizeof(T));
+
+        if (x < width)
+            memcpy(dstp + x, lut[srcp[x / 8]].data(), (width - x) * sizeof(T));
+
+        dstp += dst_pitch;
+        srcp += src_pitch;
+    }
+}
+
+CombMaskUnpack::CombMaskUnpack(PClip _child, IScriptEnvironment* env) :
+    GenericVideoFilter(_child)
+{
+    if (vi.IsRGB() || !vi.IsPlanar())
+        env->ThrowError("CombMaskUnpack: clip must be in YUV planar format.");
+    if (!env->FunctionExists("propShow"))
+        env->ThrowError("CombMaskUnpack: requires frame properties support (AviSynth+ 3.6 or later).");
+
+    switch (vi.ComponentSize())
+    {
+        case 1: unpack = unpack_c<uint8_t, 255>; break;
+        case 2:
+        {
+            switch (vi.BitsPerComponent())
+            {
+                case 10: unpack = unpack_c<uint16_t, 1023>; break;
+                case 12: unpack = unpack_c<uint16_t, 4095>; break;
+                case 14: unpack = unpack_c<uint16_t, 16383>; break;
+                default: unpack = unpack_c<uint16_t, 65535>;
+            }
+            break;
+        }
+        default: unpack = unpack_c<float, 1>;
+    }
+}
+
+PVideoFrame CombMaskUnpack::GetFrame(int n, IScriptEnvironment* env)
+{
+    PVideoFrame src{ child->GetFrame(n, env) };
+    PVideoFrame dst{ env->NewVideoFrameP(vi, &src) };
+    const AVSMap* props{ env->getFramePropsRO(src) };
+
+    // Planes without a packed mask are copied.
+    const int planes[4]{ PLANAR_Y, PLANAR_U, PLANAR_V, PLANAR_A };
+    for (int i{ 0 }; i < vi.NumComponents(); ++i)
+    {
+        const int src_pitch{ src->GetPitch(planes[i]) };
+        const int dst_pitch{ dst->GetPitch(planes[i]) };
+        const int height{ src->GetHeight(planes[i]) };
+        const int width{ src->GetRowSize(planes[i]) };
+        uint8_t* dstp{ dst->GetWritePtr(planes[i]) };
+
+        int err{ 1 };
+        const char* packedp{ (i < 3) ? env->propGetData(props, packed_names[i], 0, &err) : nullptr };
+
+        if (err)
+        {
+            env->BitBlt(dstp, dst_pitch, src->GetReadPtr(planes[i]), src_pitch, width, height);
+            continue;
+        }
+
+        const int pitch{ packed_pitch(width / vi.ComponentSize()) };
+        if (env->propGetDataSize(props, packed_names[i], 0, &err) != pitch * height)
+            env->ThrowError("CombMaskUnpack: the size of %s doesn't match the clip.", packed_names[i]);
+
+        unpack(dstp, reinterpret_cast<const uint8_t*>(packedp), dst_pitch, pitch, height, width);
+    }
 
     return dst;
 }
 
 AVSValue __cdecl Create_CombMask(AVSValue args, void* user_data, IScriptEnvironment* env)
 {
-    enum { Clip, ThY1, ThY2, Y, U, V, Usemmx, Opt };
+    enum { Clip, ThY1, ThY2, Y, U, V, Usemmx, Opt, Threads, Metrics, Cutoff, Mic, Blockx, Blocky, Packed, Luma, Outbits, Inplace, Cache, Framecache, Dedup, Progressive, Matched, Left, Top, Right, Bottom, Autobars, Fields, Candidates, Metric };
 
     return new CombMask(
         args[Clip].AsClip(),
@@ -294,9 +1368,37 @@ AVSValue __cdecl Create_CombMask(AVSValue args, void* user_data, IScriptEnvironm
         args[U].AsInt(1),
         args[V].AsInt(1),
         args[Opt].AsInt(-1),
+        args[Threads].AsInt(1),
+        args[Metrics].AsBool(false),
+        args[Cutoff].AsInt(0),
+        args[Mic].AsBool(false),
+        args[Blockx].AsInt(16),
+        args[Blocky].AsInt(16),
+        args[Packed].AsBool(false),
+        args[Luma].AsBool(false),
+        args[Outbits].AsInt(-1),
+        args[Inplace].AsBool(false),
+        args[Cache].AsString(""),
+        args[Framecache].AsInt(0),
+        args[Dedup].AsBool(false),
+        args[Progressive].AsBool(false),
+        args[Matched].AsString(""),
+        args[Left].AsInt(0),
+        args[Top].AsInt(0),
+        args[Right].AsInt(0),
+        args[Bottom].AsInt(0),
+        args[Autobars].AsBool(false),
+        args[Fields].AsBool(false),
+        args[Candidates].AsBool(false),
+        args[Metric].AsInt(0),
         env);
 }
 
+AVSValue __cdecl Create_CombMaskUnpack(AVSValue args, void* user_data, IScriptEnvironment* env)
+{
+    return new CombMaskUnpack(args[0].AsClip(), env);
+}
+
 const AVS_Linkage* AVS_linkage;
 
 extern "C" __declspec(dllexport)
@@ -304,7 +1406,8 @@ const char* __stdcall AvisynthPluginInit3(IScriptEnvironment * env, const AVS_Li
 {
     AVS_linkage = vectors;
 
-    env->AddFunction("CombMask", "c[thY1]i[thY2]i[y]i[u]i[v]i[usemmx]b[opt]i", Create_CombMask, 0);
+    env->AddFunction("CombMask", "c[thY1]i[thY2]i[y]i[u]i[v]i[usemmx]b[opt]i[threads]i[metrics]b[cutoff]i[mic]b[blockx]i[blocky]i[packed]b[luma]b[outbits]i[inplace]b[cache]s[framecache]i[dedup]b[progressive]b[matched]s[left]i[top]i[right]i[bottom]i[autobars]b[fields]b[candidates]b[metric]i", Create_CombMask, 0);
+    env->AddFunction("CombMaskUnpack", "c", Create_CombMaskUnpack, 0);
 
     return "CombMask";
 }
@@ -19,8 +19,28 @@
 // http://www.gnu.org/copyleft/gpl.html .
 
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
 
 #include "avisynth.h"
+#include "FrameCache.h"
+#include "MetricsCache.h"
+#include "ThreadPool.h"
+
+// Part of a plane where the mask is computed: columns x0..x1-1 and rows y0..y1-1.
+struct Area
+{
+    int x0, x1;
+    int y0, y1;
+};
+
+struct CombStats
+{
+    int64_t combed; // pixels above thY2
+    double sum; // sum of the mask values
+};
 
 class CombMask : public GenericVideoFilter
 {
@@ -28,11 +48,64 @@ class CombMask : public GenericVideoFilter
     int Y, U, V;
     int proccesplanes[3];
     bool has_at_least_v8;
+    bool has_at_least_v9;
+    int threads;
+    bool metrics;
+    int cutoff;
+    bool mic;
+    int blockx, blocky;
+    bool packed;
+    bool luma;
+    int outbits;
+    bool inplace;
+    std::unique_ptr<MetricsCache> cache;
+    std::unique_ptr<FrameCache> frames;
+    bool dedup;
+
+    // The last computed mask and the row hashes of its source, for dedup.
+    struct LastFrame
+    {
+        PVideoFrame mask;
+        std::vector<uint64_t> rows[4];
+    };
+
+    std::mutex last_mtx;
+    std::shared_ptr<const LastFrame> last;
+
+    bool progressive;
+    std::string matched;
+    int margins[3][4]; // left, top, right, bottom of every plane in its own pixels
+    bool autobars;
+    bool fields;
+    bool candidates;
+    int metric;
+    int reach; // rows above and below an output row read by the mask kernel
+    std::mutex zero_mtx;
+    PVideoFrame zero; // shared all-zero mask
+    std::unique_ptr<ThreadPool> pool;
 
     void (*CM)(uint8_t* __restrict, const uint8_t*, int, int, const int, int, int, int) noexcept;
+    void (*CMS)(const uint8_t*, const uint8_t*, int, const int, int, int, int, uint16_t* __restrict, CombStats&) noexcept;
+    void (*CMP)(uint8_t* __restrict, const uint8_t*, int, int, const int, int, int) noexcept;
+    void (*convert)(uint8_t* __restrict, const uint8_t*, int, int, int, int, bool) noexcept;
+
+    template <typename T, int peak, int bits>
+    void set_kernels(int opt, int iset) noexcept;
+    int stripes(int rows) const noexcept;
+    Area area(int plane, int pixels, int height) const noexcept;
+    Area scan_area(const PVideoFrame& src, int plane) const noexcept;
+    void inplace_stripe(uint8_t* dstp, int pitch, int width, int y0, int y1, const uint8_t* above, const uint8_t* below) const noexcept;
+    PVideoFrame MakeFrame(int n, IScriptEnvironment* env);
+    void RowHashes(const PVideoFrame& src, std::vector<uint64_t>* rows);
+    PVideoFrame GetMetrics(int n, PVideoFrame& src, IScriptEnvironment* env);
+    PVideoFrame PutMetrics(PVideoFrame& src, const FrameMetrics& m, IScriptEnvironment* env);
+    PVideoFrame GetPacked(PVideoFrame& src, bool skip, IScriptEnvironment* env);
+    bool Skip(const PVideoFrame& src, IScriptEnvironment* env) const;
+    PVideoFrame GetZero(const PVideoFrame& src, IScriptEnvironment* env);
+    PVideoFrame GetCandidates(int n, PVideoFrame& src, bool skip, IScriptEnvironment* env);
 
 public:
-    CombMask(PClip _child, int thY1, int thY2, int y, int u, int v, int opt, IScriptEnvironment* env);
+    CombMask(PClip _child, int thY1, int thY2, int y, int u, int v, int opt, int _threads, bool _metrics, int _cutoff, bool _mic, int _blockx, int _blocky, bool _packed, bool _luma, int _outbits, bool _inplace, const char* _cache, int framecache, bool _dedup, bool _progressive, const char* _matched, int left, int top, int right, int bottom, bool _autobars, bool _fields, bool _candidates, int _metric, IScriptEnvironment* env);
     PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env);
     int __stdcall SetCacheHints(int cachehints, int frame_range)
     {
@@ -40,9 +113,85 @@ public:
     }
 };
 
-template <typename T, int peak, int bits>
+// Expands the packed masks written by CombMask(packed=true) to mask planes.
+class CombMaskUnpack : public GenericVideoFilter
+{
+    void (*unpack)(uint8_t* __restrict, const uint8_t*, int, int, const int, int) noexcept;
+
+public:
+    CombMaskUnpack(PClip _child, IScriptEnvironment* env);
+    PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env);
+    int __stdcall SetCacheHints(int cachehints, int frame_range)
+    {
+        return cachehints == CACHE_GET_MTMODE ? MT_NICE_FILTER : 0;
+    }
+};
+
+// Row size in bytes of a packed mask: 1 bit per pixel, padded to a multiple of 64 pixels.
+inline int packed_pitch(int width) noexcept
+{
+    return (width + 63) / 64 * 8;
+}
+
+// The kernels process height rows starting at srcp_/dstp_. The rows above (srcp_ - src_pitch) and below the last one are read too.
+// Nothing past width is read or written, so the rows don't need any padding (pitch == width is fine).
+// D is the mask type. With D = uint8_t the mask of high bit depth and float clips is written as 8-bit.
+template <typename T, int peak, int bits, typename D = T>
+void CM_C(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template <typename T, int peak, int bits, typename D = T>
 void CM_SSE2(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
-template <typename T, int peak, int bits>
+// CM_SSE41 exists only for uint16_t and CM_AVX only for float.
+template <typename T, int peak, int bits, typename D = T>
+void CM_SSE41(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template <typename T, int peak, int bits, typename D = T>
+void CM_AVX(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template <typename T, int peak, int bits, typename D = T>
 void CM_AVX2(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
-template <typename T, int peak, int bits>
+template <typename T, int peak, int bits, typename D = T>
 void CM_AVX512(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+
+// The 5-tap metric of field matchers (TFM, IsCombedTIVTC): a pixel is combed if it's above or below both neighbours
+// by more than thressup and |a + 4c + e - 3(b + d)| of the rows y - 2..y + 2 is above 6 * thressup. The mask is 0 or
+// peak, thresinf isn't used (it only keeps the signature of CM_*). The kernels read two rows above and below every output row.
+template <typename T, int peak, int bits>
+void CM5_C(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template <typename T, int peak, int bits>
+void CM5_SSE2(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template <typename T, int peak, int bits>
+void CM5_AVX2(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template <typename T, int peak, int bits>
+void CM5_AVX512(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+// The stats of the 5-tap metric, the same contract as CMS_*.
+template <typename T, int peak, int bits>
+void CMS5_C(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template <typename T, int peak, int bits>
+void CMS5_SSE2(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template <typename T, int peak, int bits>
+void CMS5_AVX2(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template <typename T, int peak, int bits>
+void CMS5_AVX512(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+
+// Like CM_*, but only the number of pixels above thressup and the sum of the mask values are accumulated to stats.
+// If colsum isn't null, it receives the number of pixels above thressup of every column of the processed rows.
+// The SIMD versions store whole vectors, so colsum must have room for width rounded up to 64 pixels.
+// The rows an odd number of rows away from srcp_ (also the one above it) are read from altp_ at the same offset, so the
+// frame woven from the fields of two frames is scanned without weaving it. altp_ == srcp_ for a single frame.
+template <typename T, int peak, int bits>
+void CMS_C(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template <typename T, int peak, int bits>
+void CMS_SSE2(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template <typename T, int peak, int bits>
+void CMS_AVX2(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template <typename T, int peak, int bits>
+void CMS_AVX512(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+
+// Packs the pixels above thressup to 1 bit per pixel, bit i of byte j is the pixel 8 * j + i.
+// The padding bits after the last pixel of a row are set to 0.
+template <typename T, int peak, int bits>
+void CMP_C(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template <typename T, int peak, int bits>
+void CMP_SSE2(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template <typename T, int peak, int bits>
+void CMP_AVX2(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template <typename T, int peak, int bits>
+void CMP_AVX512(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
@@ -0,0 +1,114 @@
+#include "MTCombMask.h"
+#include "VCL2/vectorclass.h"
+
+// A row ends in a strip narrower than the vector unless the width is a multiple of it. That strip is loaded and
+// stored partially, so the kernels don't touch memory past the row and work with pitch == width.
+template <typename V, typename T>
+static inline V load_strip(const T* p, int n) noexcept
+{
+    V v;
+
+    if (n >= V::size())
+        v.load(p);
+    else
+        v.load_partial(std::max(n, 0), p);
+
+    return v;
+}
+
+// Pixels before the first mask address aligned to align bytes if every row has the same misalignment (a cropped
+// frame keeps the pitch of its parent), else 0. The first strip of a row is shortened to it, so the other stores
+// are aligned.
+template <int align, typename D>
+static inline int aligned_head(const D* d, int dst_pitch) noexcept
+{
+    const int offset{ static_cast<int>(reinterpret_cast<uintptr_t>(d) & (align - 1)) };
+
+    if (offset == 0 || (dst_pitch * sizeof(D)) % align != 0 || offset % sizeof(D) != 0)
+        return 0;
+
+    return static_cast<int>((align - offset) / sizeof(D));
+}
+
+// Stores the first size elements of v, only n of them in the last strip.
+template <int size, typename V, typename T>
+static inline void store_strip(const V& v, T* p, int n) noexcept
+{
+    if (n < size)
+        v.store_partial(n, p);
+    else if constexpr (size == V::size())
+        v.store(p);
+    else if constexpr (size * 2 == V::size())
+        v.storel(p);
+    else
+        v.store_partial(size, p);
+}
+
+// gcc folds blendvps into a generic vector select and, without the 256-bit integer compares of AVX2, expands it
+// to scalar code. and/andnot/or keep it in vector registers.
+static inline Vec8f select_ps(const Vec8fb s, const Vec8f a, const Vec8f b) noexcept
+{
+    return _mm256_or_ps(_mm256_and_ps(s, a), _mm256_andnot_ps(s, b));
+}
+
+// Only float clips: AVX has the 256-bit float instructions, the integer ones came with AVX2.
+template <typename T, int peak, int bits, typename D>
+void CM_AVX(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept
+{
+    dst_pitch /= sizeof(D);
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* s{ reinterpret_cast<const T*>(srcp_) };
+    D* __restrict d{ reinterpret_cast<D*>(dstp_) };
+
+    const Vec8f threshinf_{ thresinf / 255.0f };
+    const Vec8f thressup_{ thressup / 255.0f };
+
+    // Same band walk as CM_AVX2.
+    constexpr int band{ 16 };
+
+    const int head{ aligned_head<8 * sizeof(D)>(d, dst_pitch) };
+
+    for (int y{ 0 }; y < height; y += band)
+    {
+        const int rows{ std::min(band, height - y) };
+
+        for (int x{ 0 }, step{ (head > 0) ? head : 8 }; x < width; x += step, step = 8)
+        {
+            const int n{ std::min(width - x, step) };
+            const T* sd{ s + x + src_pitch };
+            D* dd{ d + x };
+            auto su_v{ load_strip<Vec8f>(s + x - src_pitch, n) };
+            auto s_v{ load_strip<Vec8f>(s + x, n) };
+
+            for (int r{ 0 }; r < rows; ++r)
+            {
+                const auto sd_v{ load_strip<Vec8f>(sd, n) };
+
+                const auto prod{ ((su_v - s_v) * (sd_v - s_v)) * Vec8f(255.0f) };
+
+                if constexpr (std::is_same_v<D, uint8_t>)
+                {
+                    const Vec8i mask{ roundi(select_ps(prod < threshinf_, zero_8f(),
+                        select_ps(prod > thressup_, Vec8f(255.0f), prod))) };
+
+                    store_strip<8>(compress_saturated_s2u(compress_saturated(mask.get_low(), mask.get_high()), zero_si128()), dd, n);
+                }
+                else
+                    store_strip<8>(select_ps(prod < threshinf_, zero_8f(),
+                        select_ps(prod > thressup_, Vec8f(1.0f), prod / 255.0f)), dd, n);
+
+                su_v = s_v;
+                s_v = sd_v;
+                sd += src_pitch;
+                dd += dst_pitch;
+            }
+        }
+
+        s += band * src_pitch;
+        d += band * dst_pitch;
+    }
+}
+
+template void CM_AVX<float, 1, 32>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_AVX<float, 1, 32, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
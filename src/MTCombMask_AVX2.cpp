@@ -1,99 +1,693 @@
 #include "MTCombMask.h"
 #include "VCL2/vectorclass.h"
 
-template <typename T, int peak, int bits>
+// A row ends in a strip narrower than the vector unless the width is a multiple of it. That strip is loaded and
+// stored partially, so the kernels don't touch memory past the row and work with pitch == width.
+template <typename V, typename T>
+static inline V load_strip(const T* p, int n) noexcept
+{
+    V v;
+
+    if (n >= V::size())
+        v.load(p);
+    else
+        v.load_partial(std::max(n, 0), p);
+
+    return v;
+}
+
+static inline Vec8i load_8us_strip(const uint16_t* p, int n) noexcept
+{
+    if (n >= 8)
+        return Vec8i().load_8us(p);
+
+    Vec8us v;
+    v.load_partial(std::max(n, 0), p);
+
+    return _mm256_cvtepu16_epi32(v);
+}
+
+// Pixels before the first mask address aligned to align bytes if every row has the same misalignment (a cropped
+// frame keeps the pitch of its parent), else 0. The first strip of a row is shortened to it, so the other stores
+// are aligned.
+template <int align, typename D>
+static inline int aligned_head(const D* d, int dst_pitch) noexcept
+{
+    const int offset{ static_cast<int>(reinterpret_cast<uintptr_t>(d) & (align - 1)) };
+
+    if (offset == 0 || (dst_pitch * sizeof(D)) % align != 0 || offset % sizeof(D) != 0)
+        return 0;
+
+    return static_cast<int>((align - offset) / sizeof(D));
+}
+
+// Stores the first size elements of v, only n of them in the last strip.
+template <int size, typename V, typename T>
+static inline void store_strip(const V& v, T* p, int n) noexcept
+{
+    if (n < size)
+        v.store_partial(n, p);
+    else if constexpr (size == V::size())
+        v.store(p);
+    else if constexpr (size * 2 == V::size())
+        v.storel(p);
+    else
+        v.store_partial(size, p);
+}
+
+// (su - s) * (sd - s) > thressup, exact for 8-bit pixels. The product is positive only if s is above or below both
+// neighbours and then its factors are the distances to the nearer and the farther one. They fit in 8 bits, so only
+// their product is widened and it fits in 16 bits unsigned.
+static inline Vec32cb combed_8bit(const Vec32uc su, const Vec32uc s, const Vec32uc sd, const Vec16us thressup) noexcept
+{
+    const Vec32uc lo{ min(su, sd) };
+    const Vec32uc hi{ max(su, sd) };
+    // dist_near is 0 if s is between the neighbours, which clears the product too.
+    const Vec32uc dist_near{ sub_saturated(s, hi) | sub_saturated(lo, s) };
+    const Vec32uc dist_far{ sub_saturated(s, lo) | sub_saturated(hi, s) };
+
+    // Widened within the 128-bit lanes and packed back the same way, so no lane-crossing permutes are needed. The signed
+    // saturation of packs keeps every nonzero word nonzero.
+    const __m256i zero{ _mm256_setzero_si256() };
+    const Vec16us over_lo{ sub_saturated(Vec16us(_mm256_unpacklo_epi8(dist_near, zero)) * Vec16us(_mm256_unpacklo_epi8(dist_far, zero)), thressup) };
+    const Vec16us over_hi{ sub_saturated(Vec16us(_mm256_unpackhi_epi8(dist_near, zero)) * Vec16us(_mm256_unpackhi_epi8(dist_far, zero)), thressup) };
+
+    return Vec32uc(_mm256_packs_epi16(over_lo, over_hi)) != Vec32uc(0);
+}
+
+// 5-tap metric of field matchers: c is above or below both neighbours by more than t and
+// |a + 4 * c + e - 3 * (b + d)| > 6 * t. 8-bit pixels: the gate in 8 bits, the sum in 16 bits.
+static inline Vec32uc combed5_8bit(const Vec32uc a, const Vec32uc b, const Vec32uc c, const Vec32uc d, const Vec32uc e, const Vec32uc t, const Vec16s t6) noexcept
+{
+    const Vec32cb gate{ (sub_saturated(c, max(b, d)) > t) | (sub_saturated(min(b, d), c) > t) };
+
+    const Vec16s lo{ abs(Vec16s(extend_low(a) + extend_low(e)) + (Vec16s(extend_low(c)) << 2) - Vec16s(extend_low(b) + extend_low(d)) * 3) };
+    const Vec16s hi{ abs(Vec16s(extend_high(a) + extend_high(e)) + (Vec16s(extend_high(c)) << 2) - Vec16s(extend_high(b) + extend_high(d)) * 3) };
+    const Vec32uc over{ compress(select(lo > t6, Vec16s(-1), Vec16s(0)), select(hi > t6, Vec16s(-1), Vec16s(0))) };
+
+    return select(gate, over, Vec32uc(0));
+}
+
+// 16-bit pixels: the sum in 32 bits.
+static inline Vec16us combed5_16bit(const Vec16us a, const Vec16us b, const Vec16us c, const Vec16us d, const Vec16us e, const Vec16us t, const Vec8i t6, const Vec16us peak) noexcept
+{
+    const Vec16sb gate{ (sub_saturated(c, max(b, d)) > t) | (sub_saturated(min(b, d), c) > t) };
+
+    const Vec8i lo{ abs(Vec8i(extend_low(a)) + Vec8i(extend_low(e)) + (Vec8i(extend_low(c)) << 2) - (Vec8i(extend_low(b)) + Vec8i(extend_low(d))) * 3) };
+    const Vec8i hi{ abs(Vec8i(extend_high(a)) + Vec8i(extend_high(e)) + (Vec8i(extend_high(c)) << 2) - (Vec8i(extend_high(b)) + Vec8i(extend_high(d))) * 3) };
+    const Vec16us over{ compress(select(lo > t6, Vec8i(-1), Vec8i(0)), select(hi > t6, Vec8i(-1), Vec8i(0))) };
+
+    return select(gate, over & peak, Vec16us(0));
+}
+
+// 3 * (b + d) is summed instead of multiplied, so it isn't fused with the subtraction and matches CM5_C.
+static inline Vec8f combed5_float(const Vec8f a, const Vec8f b, const Vec8f c, const Vec8f d, const Vec8f e, const Vec8f t, const Vec8f t6) noexcept
+{
+    const Vec8f d1{ c - b };
+    const Vec8f d2{ c - d };
+    const Vec8fb gate{ ((d1 > t) & (d2 > t)) | ((d1 < -t) & (d2 < -t)) };
+
+    const Vec8f bd{ b + d };
+    const Vec8fb over{ abs(a + e + c * 4.0f - (bd + bd + bd)) > t6 };
+
+    return select(gate & over, Vec8f(1.0f), Vec8f(0.0f));
+}
+
+template <typename T, int peak, int bits, typename D>
 void CM_AVX2(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept
 {
-    dst_pitch /= sizeof(T);
+    dst_pitch /= sizeof(D);
     src_pitch /= sizeof(T);
     width /= sizeof(T);
-    const T* su{ reinterpret_cast<const T*>(srcp_) };
-    T* __restrict d{ reinterpret_cast<T*>(dstp_) };
+    const T* s{ reinterpret_cast<const T*>(srcp_) };
+    D* __restrict d{ reinterpret_cast<D*>(dstp_) };
 
-    const T* s{ su + src_pitch };
-    const T* sd{ su + static_cast<int64_t>(2) * src_pitch };
+    // The rows are processed in bands. Every column strip of a band is walked down, so each source row is loaded
+    // and widened once per strip and reused from registers for the three output rows it belongs to.
+    constexpr int band{ 16 };
 
     if constexpr (std::is_same_v<T, uint8_t>)
     {
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
+        // thressup <= 255, so the values between the thresholds (prod >> 8) are always 0.
+        const Vec16us thressup_{ static_cast<uint16_t>(thressup) };
+
+        const int head{ aligned_head<32 * sizeof(D)>(d, dst_pitch) };
 
-        for (int y{ 1 }; y < height - 1; ++y)
+        for (int y{ 0 }; y < height; y += band)
         {
-            for (int x{ 0 }; x < width; x += 16)
+            const int rows{ std::min(band, height - y) };
+
+            for (int x{ 0 }, step{ (head > 0) ? head : 32 }; x < width; x += step, step = 32)
             {
-                const auto s_v{ Vec16s().load_16uc(s + x) };
+                const int n{ std::min(width - x, step) };
+                const T* sd{ s + x + src_pitch };
+                D* dd{ d + x };
+                auto su_v{ load_strip<Vec32uc>(s + x - src_pitch, n) };
+                auto s_v{ load_strip<Vec32uc>(s + x, n) };
+
+                for (int r{ 0 }; r < rows; ++r)
+                {
+                    const auto sd_v{ load_strip<Vec32uc>(sd, n) };
 
-                const auto prod{ (Vec16s().load_16uc(su + x) - s_v) * (Vec16s().load_16uc(sd + x) - s_v) };
+                    store_strip<32>(select(combed_8bit(su_v, s_v, sd_v, thressup_), Vec32uc(255), Vec32uc(0)), dd, n);
 
-                compress_saturated_s2u(select(prod < Vec16s(thresinf), zero_si256(),
-                    select(prod > Vec16s(thressup), Vec16s(255), (prod >> 8))), zero_si256()).store(d + x);
+                    su_v = s_v;
+                    s_v = sd_v;
+                    sd += src_pitch;
+                    dd += dst_pitch;
+                }
             }
 
-            d += dst_pitch;
+            s += band * src_pitch;
+            d += band * dst_pitch;
+        }
+    }
+    else if constexpr (std::is_same_v<T, uint16_t>)
+    {
+        const int head{ aligned_head<8 * sizeof(D)>(d, dst_pitch) };
+
+        for (int y{ 0 }; y < height; y += band)
+        {
+            const int rows{ std::min(band, height - y) };
+
+            for (int x{ 0 }, step{ (head > 0) ? head : 8 }; x < width; x += step, step = 8)
+            {
+                const int n{ std::min(width - x, step) };
+                const T* sd{ s + x + src_pitch };
+                D* dd{ d + x };
+                auto su_v{ load_8us_strip(s + x - src_pitch, n) };
+                auto s_v{ load_8us_strip(s + x, n) };
+
+                for (int r{ 0 }; r < rows; ++r)
+                {
+                    const auto sd_v{ load_8us_strip(sd, n) };
+
+                    const auto prod{ ((su_v - s_v) * (sd_v - s_v)) >> (bits - 8) };
+
+                    if constexpr (std::is_same_v<D, uint8_t>)
+                    {
+                        const Vec8i mask{ select(prod < Vec8i(thresinf), zero_si256(),
+                            select(prod > Vec8i(thressup), Vec8i(255), (prod >> bits))) };
+
+                        store_strip<8>(compress_saturated_s2u(compress_saturated(mask.get_low(), mask.get_high()), zero_si128()), dd, n);
+                    }
+                    else
+                    {
+                        const Vec8i mask{ select(prod < Vec8i(thresinf), zero_si256(),
+                            select(prod > Vec8i(thressup), Vec8i(peak), (prod >> 8))) };
+
+                        store_strip<8>(compress_saturated_s2u(mask.get_low(), mask.get_high()), dd, n);
+                    }
+
+                    su_v = s_v;
+                    s_v = sd_v;
+                    sd += src_pitch;
+                    dd += dst_pitch;
+                }
+            }
+
+            s += band * src_pitch;
+            d += band * dst_pitch;
+        }
+    }
+    else
+    {
+        const Vec8f threshinf_{ thresinf / 255.0f };
+        const Vec8f thressup_{ thressup / 255.0f };
+
+        const int head{ aligned_head<8 * sizeof(D)>(d, dst_pitch) };
+
+        for (int y{ 0 }; y < height; y += band)
+        {
+            const int rows{ std::min(band, height - y) };
+
+            for (int x{ 0 }, step{ (head > 0) ? head : 8 }; x < width; x += step, step = 8)
+            {
+                const int n{ std::min(width - x, step) };
+                const T* sd{ s + x + src_pitch };
+                D* dd{ d + x };
+                auto su_v{ load_strip<Vec8f>(s + x - src_pitch, n) };
+                auto s_v{ load_strip<Vec8f>(s + x, n) };
+
+                for (int r{ 0 }; r < rows; ++r)
+                {
+                    const auto sd_v{ load_strip<Vec8f>(sd, n) };
+
+                    const auto prod{ ((su_v - s_v) * (sd_v - s_v)) * Vec8f(255.0f) };
+
+                    if constexpr (std::is_same_v<D, uint8_t>)
+                    {
+                        const Vec8i mask{ roundi(select(prod < threshinf_, zero_8f(),
+                            select(prod > thressup_, Vec8f(255.0f), prod))) };
+
+                        store_strip<8>(compress_saturated_s2u(compress_saturated(mask.get_low(), mask.get_high()), zero_si128()), dd, n);
+                    }
+                    else
+                        store_strip<8>(select(prod < threshinf_, zero_8f(),
+                            select(prod > thressup_, Vec8f(1.0f), prod / 255.0f)), dd, n);
+
+                    su_v = s_v;
+                    s_v = sd_v;
+                    sd += src_pitch;
+                    dd += dst_pitch;
+                }
+            }
+
+            s += band * src_pitch;
+            d += band * dst_pitch;
+        }
+    }
+}
+
+template <typename T, int peak, int bits>
+void CMS_AVX2(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept
+{
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* srcp{ reinterpret_cast<const T*>(srcp_) };
+    const T* altp{ reinterpret_cast<const T*>(altp_) };
+
+    // The band is walked down one column strip at a time: every source row is loaded once per strip
+    // and the per-column counts stay in registers until the strip is done.
+    if constexpr (std::is_same_v<T, uint8_t>)
+    {
+        const Vec16s index(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        const Vec16us thressup_{ static_cast<uint16_t>(thressup) };
+        Vec8i combed_v{ 0 };
+
+        // thressup <= 255, so the values between the thresholds (prod >> 8) are always 0.
+        for (int x{ 0 }; x < width; x += 32)
+        {
+            const T* sd{ altp + x + src_pitch };
+            const T* sd_next{ srcp + x + 2 * src_pitch };
+            auto su_v{ load_strip<Vec32uc>(altp + x - src_pitch, width - x) };
+            auto s_v{ load_strip<Vec32uc>(srcp + x, width - x) };
+            Vec16us count_lo{ 0 };
+            Vec16us count_hi{ 0 };
+
+            // The counts are kept in 8-bit lanes and widened every 255 rows.
+            for (int y{ 0 }; y < height; y += 255)
+            {
+                const int rows{ std::min(255, height - y) };
+                Vec32uc count{ 0 };
+
+                for (int r{ 0 }; r < rows; ++r)
+                {
+                    const auto sd_v{ load_strip<Vec32uc>(sd, width - x) };
+
+                    count = if_add(combed_8bit(su_v, s_v, sd_v, thressup_), count, Vec32uc(1));
+
+                    su_v = s_v;
+                    s_v = sd_v;
+                    std::swap(sd, sd_next);
+                    sd_next += 2 * src_pitch;
+                }
+
+                count_lo += extend_low(count);
+                count_hi += extend_high(count);
+            }
+
+            if (colsum)
+            {
+                count_lo.store(colsum + x);
+                count_hi.store(colsum + x + 16);
+            }
+
+            const Vec16s lo{ select(index < Vec16s(width - x), Vec16s(count_lo), Vec16s(0)) };
+            const Vec16s hi{ select(index < Vec16s(width - x - 16), Vec16s(count_hi), Vec16s(0)) };
+            combed_v += extend_low(lo) + extend_high(lo) + extend_low(hi) + extend_high(hi);
+        }
+
+        const int64_t combed{ horizontal_add_x(combed_v) };
+
+        stats.combed += combed;
+        stats.sum += 255.0 * combed;
+    }
+    else if constexpr (std::is_same_v<T, uint16_t>)
+    {
+        const Vec8i index(0, 1, 2, 3, 4, 5, 6, 7);
+        Vec8i combed_v{ 0 };
+        Vec4q sum_v{ 0 };
+
+        for (int x{ 0 }; x < width; x += 8)
+        {
+            const T* sd{ altp + x + src_pitch };
+            const T* sd_next{ srcp + x + 2 * src_pitch };
+            auto su_v{ load_8us_strip(altp + x - src_pitch, width - x) };
+            auto s_v{ load_8us_strip(srcp + x, width - x) };
+            Vec8i count{ 0 };
+            Vec8i col_sum{ 0 };
+
+            for (int y{ 0 }; y < height; ++y)
+            {
+                const auto sd_v{ load_8us_strip(sd, width - x) };
+
+                const auto prod{ ((su_v - s_v) * (sd_v - s_v)) >> (bits - 8) };
+
+                const auto above{ prod > Vec8i(thressup) };
+
+                count = if_add(above, count, Vec8i(1));
+                col_sum = if_add(prod >= Vec8i(thresinf), col_sum, select(above, Vec8i(peak), prod >> 8));
+
+                su_v = s_v;
+                s_v = sd_v;
+                std::swap(sd, sd_next);
+                sd_next += 2 * src_pitch;
+            }
+
+            if (colsum)
+                compress(count.get_low(), count.get_high()).store(colsum + x);
+
+            const auto valid{ index < Vec8i(width - x) };
+            count = select(valid, count, Vec8i(0));
+            col_sum = select(valid, col_sum, Vec8i(0));
+
+            combed_v += count;
+            sum_v += extend_low(col_sum) + extend_high(col_sum);
+        }
+
+        stats.combed += horizontal_add_x(combed_v);
+        stats.sum += static_cast<double>(horizontal_add(sum_v));
+    }
+    else
+    {
+        const Vec8f threshinf_{ thresinf / 255.0f };
+        const Vec8f thressup_{ thressup / 255.0f };
+        const Vec8f index(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+        Vec8f combed_v{ 0.0f };
+        Vec8f sum_v{ 0.0f };
+
+        for (int x{ 0 }; x < width; x += 8)
+        {
+            const T* sd{ altp + x + src_pitch };
+            const T* sd_next{ srcp + x + 2 * src_pitch };
+            auto su_v{ load_strip<Vec8f>(altp + x - src_pitch, width - x) };
+            auto s_v{ load_strip<Vec8f>(srcp + x, width - x) };
+            Vec8f count{ 0.0f };
+            Vec8f col_sum{ 0.0f };
+
+            for (int y{ 0 }; y < height; ++y)
+            {
+                const auto sd_v{ load_strip<Vec8f>(sd, width - x) };
+
+                const auto prod{ ((su_v - s_v) * (sd_v - s_v)) * Vec8f(255.0f) };
+
+                const auto above{ prod > thressup_ };
+
+                count = if_add(above, count, Vec8f(1.0f));
+                col_sum = if_add(prod >= threshinf_, col_sum, select(above, Vec8f(1.0f), prod / 255.0f));
+
+                su_v = s_v;
+                s_v = sd_v;
+                std::swap(sd, sd_next);
+                sd_next += 2 * src_pitch;
+            }
+
+            if (colsum)
+                compress(truncatei(count).get_low(), truncatei(count).get_high()).store(colsum + x);
+
+            const auto valid{ index < Vec8f(static_cast<float>(width - x)) };
+            combed_v += select(valid, count, Vec8f(0.0f));
+            sum_v += select(valid, col_sum, Vec8f(0.0f));
+        }
+
+        stats.combed += static_cast<int64_t>(horizontal_add(combed_v));
+        stats.sum += horizontal_add(sum_v);
+    }
+}
+
+template <typename T, int peak, int bits>
+void CMP_AVX2(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept
+{
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* s{ reinterpret_cast<const T*>(srcp_) };
+
+    const T* su{ s - src_pitch };
+    const T* sd{ s + src_pitch };
+
+    if constexpr (std::is_same_v<T, uint8_t>)
+    {
+        const Vec16us thressup_{ static_cast<uint16_t>(thressup) };
+
+        for (int y{ 0 }; y < height; ++y)
+        {
+            for (int x{ 0 }; x < width; x += 32)
+            {
+                const uint32_t valid{ (width - x < 32) ? (static_cast<uint32_t>(1) << (width - x)) - 1 : static_cast<uint32_t>(0xFFFFFFFF) };
+                const uint32_t packed{ static_cast<uint32_t>(to_bits(combed_8bit(load_strip<Vec32uc>(su + x, width - x), load_strip<Vec32uc>(s + x, width - x), load_strip<Vec32uc>(sd + x, width - x), thressup_)) & valid) };
+                memcpy(dstp + x / 8, &packed, sizeof(packed));
+            }
+
+            dstp += dst_pitch;
             s += src_pitch;
             su += src_pitch;
             sd += src_pitch;
         }
-
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
     }
     else if constexpr (std::is_same_v<T, uint16_t>)
     {
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
+        const Vec8i index(0, 1, 2, 3, 4, 5, 6, 7);
 
-        for (int y{ 1 }; y < height - 1; ++y)
+        for (int y{ 0 }; y < height; ++y)
         {
             for (int x{ 0 }; x < width; x += 8)
             {
-                const auto s_v{ Vec8i().load_8us(s + x) };
+                const auto s_v{ load_8us_strip(s + x, width - x) };
 
-                const auto prod{ ((Vec8i().load_8us(su + x) - s_v) * (Vec8i().load_8us(sd + x) - s_v)) >> (bits - 8) };
+                const auto prod{ ((load_8us_strip(su + x, width - x) - s_v) * (load_8us_strip(sd + x, width - x) - s_v)) >> (bits - 8) };
 
-                compress_saturated_s2u(select(prod < Vec8i(thresinf), zero_si256(),
-                    select(prod > Vec8i(thressup), Vec8i(peak), (prod >> 8))), zero_si256()).store(d + x);
+                const uint8_t packed{ to_bits((prod > Vec8i(thressup)) & (index < Vec8i(width - x))) };
+                memcpy(dstp + x / 8, &packed, sizeof(packed));
             }
 
-            d += dst_pitch;
+            dstp += dst_pitch;
             s += src_pitch;
             su += src_pitch;
             sd += src_pitch;
         }
-
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
     }
     else
     {
-        const Vec8f threshinf_{ thresinf / 255.0f };
         const Vec8f thressup_{ thressup / 255.0f };
+        const Vec8f index(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
 
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
-
-        for (int y{ 1 }; y < height - 1; ++y)
+        for (int y{ 0 }; y < height; ++y)
         {
             for (int x{ 0 }; x < width; x += 8)
             {
-                const auto s_v{ Vec8f().load(s + x) };
+                const auto s_v{ load_strip<Vec8f>(s + x, width - x) };
 
-                const auto prod{ ((Vec8f().load(su + x) - s_v) * (Vec8f().load(sd + x) - s_v)) * Vec8f(255.0f) };
+                const auto prod{ ((load_strip<Vec8f>(su + x, width - x) - s_v) * (load_strip<Vec8f>(sd + x, width - x) - s_v)) * Vec8f(255.0f) };
 
-                select(prod < threshinf_, zero_8f(),
-                    select(prod > thressup_, Vec8f(1.0f), prod / 255.0f)).store_nt(d + x);
+                const uint8_t packed{ to_bits((prod > thressup_) & (index < Vec8f(static_cast<float>(width - x)))) };
+                memcpy(dstp + x / 8, &packed, sizeof(packed));
             }
 
-            d += dst_pitch;
+            dstp += dst_pitch;
             s += src_pitch;
             su += src_pitch;
             sd += src_pitch;
         }
+    }
+}
+
+template <typename T, int peak, int bits>
+void CM5_AVX2(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, [[maybe_unused]] int thresinf, int thressup) noexcept
+{
+    dst_pitch /= sizeof(T);
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* s{ reinterpret_cast<const T*>(srcp_) };
+    T* __restrict d{ reinterpret_cast<T*>(dstp_) };
+
+    using V = std::conditional_t<std::is_same_v<T, uint8_t>, Vec32uc, std::conditional_t<std::is_same_v<T, uint16_t>, Vec16us, Vec8f>>;
+
+    // Same band walk as CM_AVX2, with the two rows above and below an output row in registers.
+    constexpr int band{ 16 };
+
+    auto walk{ [&](auto combed)
+        {
+            for (int y{ 0 }; y < height; y += band)
+            {
+                const int rows{ std::min(band, height - y) };
+
+                for (int x{ 0 }; x < width; x += V::size())
+                {
+                    const int n{ std::min(width - x, V::size()) };
+                    const T* se{ s + x + 2 * src_pitch };
+                    T* dd{ d + x };
+                    auto a_v{ load_strip<V>(s + x - 2 * src_pitch, n) };
+                    auto b_v{ load_strip<V>(s + x - src_pitch, n) };
+                    auto c_v{ load_strip<V>(s + x, n) };
+                    auto d_v{ load_strip<V>(s + x + src_pitch, n) };
+
+                    for (int r{ 0 }; r < rows; ++r)
+                    {
+                        const auto e_v{ load_strip<V>(se, n) };
+
+                        store_strip<V::size()>(combed(a_v, b_v, c_v, d_v, e_v), dd, n);
+
+                        a_v = b_v;
+                        b_v = c_v;
+                        c_v = d_v;
+                        d_v = e_v;
+                        se += src_pitch;
+                        dd += dst_pitch;
+                    }
+                }
+
+                s += band * src_pitch;
+                d += band * dst_pitch;
+            }
+        } };
+
+    if constexpr (std::is_same_v<T, uint8_t>)
+    {
+        const Vec32uc t{ static_cast<uint8_t>(thressup) };
+        const Vec16s t6{ static_cast<int16_t>(thressup * 6) };
+
+        walk([&](const V a, const V b, const V c, const V d, const V e) { return combed5_8bit(a, b, c, d, e, t, t6); });
+    }
+    else if constexpr (std::is_same_v<T, uint16_t>)
+    {
+        const Vec16us t{ static_cast<uint16_t>(thressup) };
+        const Vec8i t6{ thressup * 6 };
+        const Vec16us peak_{ static_cast<uint16_t>(peak) };
+
+        walk([&](const V a, const V b, const V c, const V d, const V e) { return combed5_16bit(a, b, c, d, e, t, t6, peak_); });
+    }
+    else
+    {
+        const Vec8f t{ thressup / 255.0f };
+        const Vec8f t6{ thressup / 255.0f * 6 };
+
+        walk([&](const V a, const V b, const V c, const V d, const V e) { return combed5_float(a, b, c, d, e, t, t6); });
+    }
+}
+
+template <typename T, int peak, int bits>
+void CMS5_AVX2(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, [[maybe_unused]] int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept
+{
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* srcp{ reinterpret_cast<const T*>(srcp_) };
+    const T* altp{ reinterpret_cast<const T*>(altp_) };
+
+    using V = std::conditional_t<std::is_same_v<T, uint8_t>, Vec32uc, std::conditional_t<std::is_same_v<T, uint16_t>, Vec16us, Vec8f>>;
+
+    // Same strip walk as CMS_AVX2 with the two rows above and below in registers, every call returns the next row.
+    // The rows an odd number of rows away from srcp are read from altp. The lanes past the row are loaded as 0 and
+    // are never combed, so they add nothing to the counts.
+    auto strip{ [&](int x, auto combed)
+        {
+            const int n{ std::min(width - x, V::size()) };
+
+            return [=, se = srcp + x + 2 * src_pitch, se_next = altp + x + 3 * src_pitch, a_v = load_strip<V>(srcp + x - 2 * src_pitch, n),
+                b_v = load_strip<V>(altp + x - src_pitch, n), c_v = load_strip<V>(srcp + x, n), d_v = load_strip<V>(altp + x + src_pitch, n)]() mutable noexcept
+            {
+                const auto e_v{ load_strip<V>(se, n) };
+                const auto r{ combed(a_v, b_v, c_v, d_v, e_v) };
+
+                a_v = b_v;
+                b_v = c_v;
+                c_v = d_v;
+                d_v = e_v;
+                std::swap(se, se_next);
+                se_next += 2 * src_pitch;
+
+                return r;
+            };
+        } };
+
+    int64_t combed{ 0 };
+
+    if constexpr (std::is_same_v<T, uint8_t>)
+    {
+        const Vec32uc t{ static_cast<uint8_t>(thressup) };
+        const Vec16s t6{ static_cast<int16_t>(thressup * 6) };
+        Vec8i combed_v{ 0 };
+
+        for (int x{ 0 }; x < width; x += V::size())
+        {
+            auto next{ strip(x, [&](const V a, const V b, const V c, const V d, const V e) { return combed5_8bit(a, b, c, d, e, t, t6) != V(0); }) };
+            Vec16us count_lo{ 0 };
+            Vec16us count_hi{ 0 };
+
+            // The counts are kept in 8-bit lanes and widened every 255 rows.
+            for (int y{ 0 }; y < height; y += 255)
+            {
+                const int rows{ std::min(255, height - y) };
+                V count{ 0 };
+
+                for (int r{ 0 }; r < rows; ++r)
+                    count = if_add(next(), count, V(1));
+
+                count_lo += extend_low(count);
+                count_hi += extend_high(count);
+            }
+
+            if (colsum)
+            {
+                count_lo.store(colsum + x);
+                count_hi.store(colsum + x + 16);
+            }
+
+            combed_v += Vec8i(extend_low(count_lo)) + Vec8i(extend_high(count_lo)) + Vec8i(extend_low(count_hi)) + Vec8i(extend_high(count_hi));
+        }
+
+        combed = horizontal_add_x(combed_v);
+    }
+    else if constexpr (std::is_same_v<T, uint16_t>)
+    {
+        const V t{ static_cast<uint16_t>(thressup) };
+        const Vec8i t6{ thressup * 6 };
+        const V peak_{ static_cast<uint16_t>(peak) };
+        Vec8i combed_v{ 0 };
+
+        // colsum is 16-bit, so are the counts.
+        for (int x{ 0 }; x < width; x += V::size())
+        {
+            auto next{ strip(x, [&](const V a, const V b, const V c, const V d, const V e) { return combed5_16bit(a, b, c, d, e, t, t6, peak_) != V(0); }) };
+            V count{ 0 };
+
+            for (int y{ 0 }; y < height; ++y)
+                count = if_add(next(), count, V(1));
+
+            if (colsum)
+                count.store(colsum + x);
+
+            combed_v += Vec8i(extend_low(count)) + Vec8i(extend_high(count));
+        }
 
-        memset(d, 0, dst_pitch * sizeof(T));
-        d += dst_pitch;
+        combed = horizontal_add_x(combed_v);
     }
+    else
+    {
+        const V t{ thressup / 255.0f };
+        const V t6{ thressup / 255.0f * 6 };
+        V combed_v{ 0.0f };
+
+        for (int x{ 0 }; x < width; x += V::size())
+        {
+            // The mask of combed5_float is 1.0 or 0.0 and is added as it is.
+            auto next{ strip(x, [&](const V a, const V b, const V c, const V d, const V e) { return combed5_float(a, b, c, d, e, t, t6); }) };
+            V count{ 0.0f };
+
+            for (int y{ 0 }; y < height; ++y)
+                count += next();
+
+            if (colsum)
+                compress(truncatei(count).get_low(), truncatei(count).get_high()).store(colsum + x);
+
+            combed_v += count;
+        }
+
+        combed = static_cast<int64_t>(horizontal_add(combed_v));
+    }
+
+    stats.combed += combed;
+    stats.sum += static_cast<double>(peak) * combed;
 }
 
 template void CM_AVX2<uint8_t, 255, 8>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
@@ -102,3 +696,36 @@ template void CM_AVX2<uint16_t, 4095, 12>(uint8_t* __restrict dstp_, const uint8
 template void CM_AVX2<uint16_t, 16383, 14>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
 template void CM_AVX2<uint16_t, 65535, 16>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
 template void CM_AVX2<float, 1, 32>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_AVX2<uint16_t, 1023, 10, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_AVX2<uint16_t, 4095, 12, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_AVX2<uint16_t, 16383, 14, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_AVX2<uint16_t, 65535, 16, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_AVX2<float, 1, 32, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+
+template void CMS_AVX2<uint8_t, 255, 8>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS_AVX2<uint16_t, 1023, 10>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS_AVX2<uint16_t, 4095, 12>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS_AVX2<uint16_t, 16383, 14>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS_AVX2<uint16_t, 65535, 16>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS_AVX2<float, 1, 32>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+
+template void CMP_AVX2<uint8_t, 255, 8>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template void CMP_AVX2<uint16_t, 1023, 10>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template void CMP_AVX2<uint16_t, 4095, 12>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template void CMP_AVX2<uint16_t, 16383, 14>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template void CMP_AVX2<uint16_t, 65535, 16>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template void CMP_AVX2<float, 1, 32>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+
+template void CM5_AVX2<uint8_t, 255, 8>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM5_AVX2<uint16_t, 1023, 10>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM5_AVX2<uint16_t, 4095, 12>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM5_AVX2<uint16_t, 16383, 14>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM5_AVX2<uint16_t, 65535, 16>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM5_AVX2<float, 1, 32>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+
+template void CMS5_AVX2<uint8_t, 255, 8>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS5_AVX2<uint16_t, 1023, 10>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS5_AVX2<uint16_t, 4095, 12>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS5_AVX2<uint16_t, 16383, 14>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS5_AVX2<uint16_t, 65535, 16>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS5_AVX2<float, 1, 32>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
@@ -0,0 +1,379 @@
+#include <cmath>
+
+#include "MTCombMask.h"
+
+template <typename T, int peak, int bits, typename D>
+void CM_C(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept
+{
+    dst_pitch /= sizeof(D);
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* s{ reinterpret_cast<const T*>(srcp_) };
+    D* __restrict d{ reinterpret_cast<D*>(dstp_) };
+
+    const T* su{ s - src_pitch };
+    const T* sd{ s + src_pitch };
+
+    if constexpr (std::is_same_v<T, uint8_t>)
+    {
+        for (int y{ 0 }; y < height; ++y)
+        {
+            for (int x{ 0 }; x < width; ++x)
+            {
+                const int prod{ (su[x] - s[x]) * (sd[x] - s[x]) };
+
+                if (prod < thresinf)
+                    d[x] = 0;
+                else if (prod > thressup)
+                    d[x] = 255;
+                else
+                    d[x] = prod >> 8;
+            }
+
+            d += dst_pitch;
+            s += src_pitch;
+            su += src_pitch;
+            sd += src_pitch;
+        }
+    }
+    else if constexpr (std::is_same_v<T, uint16_t>)
+    {
+        for (int y{ 0 }; y < height; ++y)
+        {
+            for (int x{ 0 }; x < width; ++x)
+            {
+                const int prod{ ((su[x] - s[x]) * (sd[x] - s[x])) >> (bits - 8) };
+
+                if (prod < thresinf)
+                    d[x] = 0;
+                else if (prod > thressup)
+                    d[x] = (std::is_same_v<D, uint8_t>) ? 255 : peak;
+                else
+                    d[x] = (std::is_same_v<D, uint8_t>) ? prod >> bits : prod >> 8;
+            }
+
+            d += dst_pitch;
+            s += src_pitch;
+            su += src_pitch;
+            sd += src_pitch;
+        }
+    }
+    else
+    {
+        const float threshinf_{ thresinf / 255.0f };
+        const float thressup_{ thressup / 255.0f };
+
+        for (int y{ 0 }; y < height; ++y)
+        {
+            for (int x{ 0 }; x < width; ++x)
+            {
+                const float prod{ ((su[x] - s[x]) * (sd[x] - s[x])) * 255.0f };
+
+                if constexpr (std::is_same_v<D, uint8_t>)
+                {
+                    if (prod < threshinf_)
+                        d[x] = 0;
+                    else if (prod > thressup_)
+                        d[x] = 255;
+                    else
+                        d[x] = static_cast<uint8_t>(std::lrint(prod));
+                }
+                else
+                {
+                    if (prod < threshinf_)
+                        d[x] = 0.0f;
+                    else if (prod > thressup_)
+                        d[x] = 1.0f;
+                    else
+                        d[x] = prod / 255.0f;
+                }
+            }
+
+            d += dst_pitch;
+            s += src_pitch;
+            su += src_pitch;
+            sd += src_pitch;
+        }
+    }
+}
+
+template <typename T, int peak, int bits>
+void CMS_C(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept
+{
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* s{ reinterpret_cast<const T*>(srcp_) };
+    // The same row of the frame the neighbours are read from.
+    const T* a{ reinterpret_cast<const T*>(altp_) };
+
+    const T* su{ a - src_pitch };
+    const T* sd{ a + src_pitch };
+
+    int64_t combed{ 0 };
+
+    if (colsum)
+        std::fill_n(colsum, width, static_cast<uint16_t>(0));
+
+    if constexpr (std::is_same_v<T, uint8_t>)
+    {
+        // thressup <= 255, so the values between the thresholds (prod >> 8) are always 0.
+        for (int y{ 0 }; y < height; ++y)
+        {
+            for (int x{ 0 }; x < width; ++x)
+            {
+                if ((su[x] - s[x]) * (sd[x] - s[x]) > thressup)
+                {
+                    ++combed;
+
+                    if (colsum)
+                        ++colsum[x];
+                }
+            }
+
+            std::swap(s, a);
+            s += src_pitch;
+            a += src_pitch;
+            su = a - src_pitch;
+            sd = a + src_pitch;
+        }
+
+        stats.combed += combed;
+        stats.sum += 255.0 * combed;
+    }
+    else if constexpr (std::is_same_v<T, uint16_t>)
+    {
+        int64_t sum{ 0 };
+
+        for (int y{ 0 }; y < height; ++y)
+        {
+            for (int x{ 0 }; x < width; ++x)
+            {
+                const int prod{ ((su[x] - s[x]) * (sd[x] - s[x])) >> (bits - 8) };
+
+                if (prod > thressup)
+                {
+                    ++combed;
+
+                    if (colsum)
+                        ++colsum[x];
+
+                    sum += peak;
+                }
+                else if (prod >= thresinf)
+                    sum += prod >> 8;
+            }
+
+            std::swap(s, a);
+            s += src_pitch;
+            a += src_pitch;
+            su = a - src_pitch;
+            sd = a + src_pitch;
+        }
+
+        stats.combed += combed;
+        stats.sum += static_cast<double>(sum);
+    }
+    else
+    {
+        const float threshinf_{ thresinf / 255.0f };
+        const float thressup_{ thressup / 255.0f };
+
+        double sum{ 0.0 };
+
+        for (int y{ 0 }; y < height; ++y)
+        {
+            for (int x{ 0 }; x < width; ++x)
+            {
+                const float prod{ ((su[x] - s[x]) * (sd[x] - s[x])) * 255.0f };
+
+                if (prod > thressup_)
+                {
+                    ++combed;
+
+                    if (colsum)
+                        ++colsum[x];
+
+                    sum += 1.0;
+                }
+                else if (prod >= threshinf_)
+                    sum += prod / 255.0f;
+            }
+
+            std::swap(s, a);
+            s += src_pitch;
+            a += src_pitch;
+            su = a - src_pitch;
+            sd = a + src_pitch;
+        }
+
+        stats.combed += combed;
+        stats.sum += sum;
+    }
+}
+
+template <typename T, int peak, int bits>
+void CMP_C(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept
+{
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* s{ reinterpret_cast<const T*>(srcp_) };
+
+    const T* su{ s - src_pitch };
+    const T* sd{ s + src_pitch };
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        for (int x{ 0 }; x < width; x += 8)
+        {
+            uint8_t packed{ 0 };
+
+            for (int i{ 0 }; i < std::min(width - x, 8); ++i)
+            {
+                bool above;
+
+                if constexpr (std::is_same_v<T, float>)
+                    above = (su[x + i] - s[x + i]) * (sd[x + i] - s[x + i]) * 255.0f > thressup / 255.0f;
+                else if constexpr (std::is_same_v<T, uint16_t>)
+                    above = (((su[x + i] - s[x + i]) * (sd[x + i] - s[x + i])) >> (bits - 8)) > thressup;
+                else
+                    above = (su[x + i] - s[x + i]) * (sd[x + i] - s[x + i]) > thressup;
+
+                packed |= above << i;
+            }
+
+            dstp[x / 8] = packed;
+        }
+
+        dstp += dst_pitch;
+        s += src_pitch;
+        su += src_pitch;
+        sd += src_pitch;
+    }
+}
+
+template <typename T, int peak, int bits>
+void CM5_C(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, [[maybe_unused]] int thresinf, int thressup) noexcept
+{
+    dst_pitch /= sizeof(T);
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* s{ reinterpret_cast<const T*>(srcp_) };
+    T* __restrict d{ reinterpret_cast<T*>(dstp_) };
+
+    // int for the integer clips: the 5-tap sum of 16-bit pixels needs 20 bits.
+    using V = std::conditional_t<std::is_same_v<T, float>, float, int>;
+    const V t{ std::is_same_v<T, float> ? static_cast<V>(thressup / 255.0f) : static_cast<V>(thressup) };
+    const V t6{ t * 6 };
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        for (int x{ 0 }; x < width; ++x)
+        {
+            const V a{ s[x - 2 * src_pitch] };
+            const V b{ s[x - src_pitch] };
+            const V c{ s[x] };
+            const V dn{ s[x + src_pitch] };
+            const V e{ s[x + 2 * src_pitch] };
+            const V bd{ b + dn };
+            const V d1{ c - b };
+            const V d2{ c - dn };
+
+            // The same order of operations as the SIMD versions, so float clips give the same mask.
+            const bool combed{ ((d1 > t && d2 > t) || (d1 < -t && d2 < -t)) && std::abs(a + e + c * 4 - (bd + bd + bd)) > t6 };
+
+            d[x] = combed ? static_cast<T>(peak) : static_cast<T>(0);
+        }
+
+        s += src_pitch;
+        d += dst_pitch;
+    }
+}
+
+template <typename T, int peak, int bits>
+void CMS5_C(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, [[maybe_unused]] int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept
+{
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* s{ reinterpret_cast<const T*>(srcp_) };
+    // The same row of the frame the rows an odd number of rows away are read from.
+    const T* alt{ reinterpret_cast<const T*>(altp_) };
+
+    using V = std::conditional_t<std::is_same_v<T, float>, float, int>;
+    const V t{ std::is_same_v<T, float> ? static_cast<V>(thressup / 255.0f) : static_cast<V>(thressup) };
+    const V t6{ t * 6 };
+
+    int64_t combed{ 0 };
+
+    if (colsum)
+        std::fill_n(colsum, width, static_cast<uint16_t>(0));
+
+    for (int y{ 0 }; y < height; ++y)
+    {
+        for (int x{ 0 }; x < width; ++x)
+        {
+            const V a{ s[x - 2 * src_pitch] };
+            const V b{ alt[x - src_pitch] };
+            const V c{ s[x] };
+            const V dn{ alt[x + src_pitch] };
+            const V e{ s[x + 2 * src_pitch] };
+            const V bd{ b + dn };
+            const V d1{ c - b };
+            const V d2{ c - dn };
+
+            if (((d1 > t && d2 > t) || (d1 < -t && d2 < -t)) && std::abs(a + e + c * 4 - (bd + bd + bd)) > t6)
+            {
+                ++combed;
+
+                if (colsum)
+                    ++colsum[x];
+            }
+        }
+
+        std::swap(s, alt);
+        s += src_pitch;
+        alt += src_pitch;
+    }
+
+    stats.combed += combed;
+    stats.sum += static_cast<double>(peak) * combed;
+}
+
+template void CM_C<uint8_t, 255, 8>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_C<uint16_t, 1023, 10>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_C<uint16_t, 4095, 12>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_C<uint16_t, 16383, 14>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_C<uint16_t, 65535, 16>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_C<float, 1, 32>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_C<uint16_t, 1023, 10, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_C<uint16_t, 4095, 12, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_C<uint16_t, 16383, 14, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_C<uint16_t, 65535, 16, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_C<float, 1, 32, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+
+template void CMS_C<uint8_t, 255, 8>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS_C<uint16_t, 1023, 10>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS_C<uint16_t, 4095, 12>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS_C<uint16_t, 16383, 14>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS_C<uint16_t, 65535, 16>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS_C<float, 1, 32>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+
+template void CMP_C<uint8_t, 255, 8>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template void CMP_C<uint16_t, 1023, 10>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template void CMP_C<uint16_t, 4095, 12>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template void CMP_C<uint16_t, 16383, 14>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template void CMP_C<uint16_t, 65535, 16>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+template void CMP_C<float, 1, 32>(uint8_t* __restrict dstp, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thressup) noexcept;
+
+template void CM5_C<uint8_t, 255, 8>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM5_C<uint16_t, 1023, 10>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM5_C<uint16_t, 4095, 12>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM5_C<uint16_t, 16383, 14>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM5_C<uint16_t, 65535, 16>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM5_C<float, 1, 32>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+
+template void CMS5_C<uint8_t, 255, 8>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS5_C<uint16_t, 1023, 10>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS5_C<uint16_t, 4095, 12>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS5_C<uint16_t, 16383, 14>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS5_C<uint16_t, 65535, 16>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
+template void CMS5_C<float, 1, 32>(const uint8_t* srcp_, const uint8_t* altp_, int src_pitch, const int height, int width, int thresinf, int thressup, uint16_t* __restrict colsum, CombStats& stats) noexcept;
@@ -0,0 +1,126 @@
+#include "MTCombMask.h"
+#include "VCL2/vectorclass.h"
+
+// A row ends in a strip narrower than the vector unless the width is a multiple of it. That strip is loaded and
+// stored partially, so the kernels don't touch memory past the row and work with pitch == width.
+template <typename V, typename T>
+static inline V load_strip(const T* p, int n) noexcept
+{
+    V v;
+
+    if (n >= V::size())
+        v.load(p);
+    else
+        v.load_partial(std::max(n, 0), p);
+
+    return v;
+}
+
+// Pixels before the first mask address aligned to align bytes if every row has the same misalignment (a cropped
+// frame keeps the pitch of its parent), else 0. The first strip of a row is shortened to it, so the other stores
+// are aligned.
+template <int align, typename D>
+static inline int aligned_head(const D* d, int dst_pitch) noexcept
+{
+    const int offset{ static_cast<int>(reinterpret_cast<uintptr_t>(d) & (align - 1)) };
+
+    if (offset == 0 || (dst_pitch * sizeof(D)) % align != 0 || offset % sizeof(D) != 0)
+        return 0;
+
+    return static_cast<int>((align - offset) / sizeof(D));
+}
+
+// Stores the first size elements of v, only n of them in the last strip.
+template <int size, typename V, typename T>
+static inline void store_strip(const V& v, T* p, int n) noexcept
+{
+    if (n < size)
+        v.store_partial(n, p);
+    else if constexpr (size == V::size())
+        v.store(p);
+    else if constexpr (size * 2 == V::size())
+        v.storel(p);
+    else
+        v.store_partial(size, p);
+}
+
+// Mask values of four pixels, prod is already scaled to the 8-bit thresholds.
+template <int peak, int bits, typename D>
+static inline Vec4i mask_16bit(const Vec4i prod, const Vec4i thresinf, const Vec4i thressup) noexcept
+{
+    if constexpr (std::is_same_v<D, uint8_t>)
+        return select(prod < thresinf, zero_si128(), select(prod > thressup, Vec4i(255), (prod >> bits)));
+    else
+        return select(prod < thresinf, zero_si128(), select(prod > thressup, Vec4i(peak), (prod >> 8)));
+}
+
+// Only 16-bit clips: the SSE2 version has to emulate pmulld and packusdw.
+template <typename T, int peak, int bits, typename D>
+void CM_SSE41(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept
+{
+    dst_pitch /= sizeof(D);
+    src_pitch /= sizeof(T);
+    width /= sizeof(T);
+    const T* s{ reinterpret_cast<const T*>(srcp_) };
+    D* __restrict d{ reinterpret_cast<D*>(dstp_) };
+
+    const Vec4i thresinf_{ thresinf };
+    const Vec4i thressup_{ thressup };
+
+    // Same band walk as CM_SSE2, but with eight pixels per strip kept as two widened halves.
+    constexpr int band{ 16 };
+
+    const int head{ aligned_head<8 * sizeof(D)>(d, dst_pitch) };
+
+    for (int y{ 0 }; y < height; y += band)
+    {
+        const int rows{ std::min(band, height - y) };
+
+        for (int x{ 0 }, step{ (head > 0) ? head : 8 }; x < width; x += step, step = 8)
+        {
+            const int n{ std::min(width - x, step) };
+            const T* sd{ s + x + src_pitch };
+            D* dd{ d + x };
+            const Vec8us su_v{ load_strip<Vec8us>(s + x - src_pitch, n) };
+            const Vec8us s_v{ load_strip<Vec8us>(s + x, n) };
+            Vec4i su_lo{ extend_low(su_v) };
+            Vec4i su_hi{ extend_high(su_v) };
+            Vec4i s_lo{ extend_low(s_v) };
+            Vec4i s_hi{ extend_high(s_v) };
+
+            for (int r{ 0 }; r < rows; ++r)
+            {
+                const Vec8us sd_v{ load_strip<Vec8us>(sd, n) };
+                const Vec4i sd_lo{ extend_low(sd_v) };
+                const Vec4i sd_hi{ extend_high(sd_v) };
+
+                const Vec4i lo{ mask_16bit<peak, bits, D>(((su_lo - s_lo) * (sd_lo - s_lo)) >> (bits - 8), thresinf_, thressup_) };
+                const Vec4i hi{ mask_16bit<peak, bits, D>(((su_hi - s_hi) * (sd_hi - s_hi)) >> (bits - 8), thresinf_, thressup_) };
+
+                if constexpr (std::is_same_v<D, uint8_t>)
+                    store_strip<8>(compress_saturated_s2u(compress_saturated(lo, hi), zero_si128()), dd, n);
+                else
+                    store_strip<8>(compress_saturated_s2u(lo, hi), dd, n);
+
+                su_lo = s_lo;
+                su_hi = s_hi;
+                s_lo = sd_lo;
+                s_hi = sd_hi;
+                sd += src_pitch;
+                dd += dst_pitch;
+            }
+        }
+
+        s += band * src_pitch;
+        d += band * dst_pitch;
+    }
+}
+
+template void CM_SSE41<uint16_t, 1023, 10>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_SSE41<uint16_t, 4095, 12>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_SSE41<uint16_t, 16383, 14>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_SSE41<uint16_t, 65535, 16>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_SSE41<uint16_t, 1023, 10, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_SSE41<uint16_t, 4095, 12, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_SSE41<uint16_t, 16383, 14, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
+template void CM_SSE41<uint16_t, 65535, 16, uint8_t>(uint8_t* __restrict dstp_, const uint8_t* srcp_, int dst_pitch, int src_pitch, const int height, int width, int thresinf, int thressup) noexcept;
@@ -0,0 +1,181 @@
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "MetricsCache.h"
+
+namespace
+{
+    struct CacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+        uint64_t key;
+        int64_t frames;
+        uint8_t reserved[32];
+    };
+
+    constexpr char cache_magic[8]{ 'C', 'M', 'M', 'E', 'T', 'R', 'I', 'C' };
+    constexpr uint32_t cache_version{ 1 };
+}
+
+MetricsCache::MetricsCache(const char* _path, int _frames, uint64_t key) : data(nullptr), frames(_frames)
+{
+    size = sizeof(CacheHeader) + sizeof(FrameMetrics) * static_cast<size_t>(frames);
+
+    CacheHeader header{};
+    int64_t file_size{ 0 };
+
+#ifdef _WIN32
+    mapping = nullptr;
+    file = CreateFileA(_path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("can't open the cache file.");
+
+    LARGE_INTEGER fs;
+    DWORD bytes{ 0 };
+    if (GetFileSizeEx(file, &fs))
+        file_size = fs.QuadPart;
+    if (file_size >= static_cast<int64_t>(sizeof(header)))
+        ReadFile(file, &header, sizeof(header), &bytes, nullptr);
+#else
+    fd = open(_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        throw std::runtime_error("can't open the cache file.");
+
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+        file_size = st.st_size;
+    if (file_size >= static_cast<int64_t>(sizeof(header)) && pread(fd, &header, sizeof(header), 0) != sizeof(header))
+        file_size = 0;
+#endif
+
+    // Don't clobber a file that isn't a cache, the path may be a typo.
+    if (file_size > 0 && (file_size < static_cast<int64_t>(sizeof(header)) || memcmp(header.magic, cache_magic, sizeof(cache_magic))))
+    {
+        close();
+        throw std::runtime_error("the cache file isn't a CombMask metrics cache.");
+    }
+
+    const bool reset{ file_size != static_cast<int64_t>(size) || header.version != cache_version || header.record_size != sizeof(FrameMetrics) ||
+        header.key != key || header.frames != frames };
+
+    // Truncating first zeroes all records.
+#ifdef _WIN32
+    bool ok{ true };
+    if (reset)
+    {
+        LARGE_INTEGER pos{};
+        ok = SetFilePointerEx(file, pos, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+        pos.QuadPart = static_cast<LONGLONG>(size);
+        ok = ok && SetFilePointerEx(file, pos, nullptr, FILE_BEGIN) && SetEndOfFile(file);
+    }
+
+    if (ok)
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32), static_cast<DWORD>(size), nullptr);
+    if (mapping)
+        data = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+#else
+    bool ok{ !reset || (ftruncate(fd, 0) == 0 && ftruncate(fd, static_cast<off_t>(size)) == 0) };
+
+    if (ok)
+    {
+        void* p{ mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) };
+        if (p != MAP_FAILED)
+            data = static_cast<uint8_t*>(p);
+    }
+#endif
+
+    if (!data)
+    {
+        close();
+        throw std::runtime_error("can't map the cache file.");
+    }
+
+    if (reset)
+    {
+        header = CacheHeader{};
+        memcpy(header.magic, cache_magic, sizeof(cache_magic));
+        header.version = cache_version;
+        header.record_size = sizeof(FrameMetrics);
+        header.key = key;
+        header.frames = frames;
+        memcpy(data, &header, sizeof(header));
+    }
+}
+
+MetricsCache::~MetricsCache()
+{
+    close();
+}
+
+void MetricsCache::close() noexcept
+{
+#ifdef _WIN32
+    if (data)
+        UnmapViewOfFile(data);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (data)
+        munmap(data, size);
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+#endif
+    data = nullptr;
+}
+
+bool MetricsCache::read(int n, uint32_t state, FrameMetrics& m) const noexcept
+{
+    if (n < 0 || n >= frames)
+        return false;
+
+    const uint8_t* record{ data + sizeof(CacheHeader) + sizeof(FrameMetrics) * static_cast<size_t>(n) };
+
+    // The state is written last, so the rest of a record is complete once it's set.
+    uint32_t s;
+    memcpy(&s, record + offsetof(FrameMetrics, state), sizeof(s));
+    if (s < state)
+        return false;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    memcpy(&m, record, sizeof(m));
+    m.state = s;
+
+    return true;
+}
+
+void MetricsCache::write(int n, const FrameMetrics& m) noexcept
+{
+    if (n < 0 || n >= frames)
+        return;
+
+    uint8_t* record{ data + sizeof(CacheHeader) + sizeof(FrameMetrics) * static_cast<size_t>(n) };
+
+    // An existing record with all metrics isn't replaced by one with only is_combed.
+    uint32_t s;
+    memcpy(&s, record + offsetof(FrameMetrics, state), sizeof(s));
+    if (s > m.state)
+        return;
+
+    memcpy(record + sizeof(m.state), reinterpret_cast<const uint8_t*>(&m) + sizeof(m.state), sizeof(m) - sizeof(m.state));
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(record + offsetof(FrameMetrics, state), &m.state, sizeof(m.state));
+}
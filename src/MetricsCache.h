@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Metrics of one frame as stored in the cache file.
+struct FrameMetrics
+{
+    uint32_t state; // 0: not computed, 1: only is_combed, 2: all metrics
+    uint32_t is_combed;
+    int64_t combed[3];
+    double mean[3];
+    int32_t mic;
+    int32_t mic_x;
+    int32_t mic_y;
+    int32_t reserved;
+};
+
+// Memory-mapped file with one FrameMetrics record per frame.
+// The header holds a key of the clip properties and the parameters. A file with another key or number of frames is
+// cleared, so stale metrics are never returned. Records of different frames may be read and written from several
+// threads at once.
+class MetricsCache
+{
+    uint8_t* data;
+    size_t size;
+    int frames;
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#else
+    int fd;
+#endif
+
+    void close() noexcept;
+
+public:
+    // Throws std::runtime_error if the file can't be opened or isn't a metrics cache.
+    MetricsCache(const char* _path, int _frames, uint64_t key);
+    ~MetricsCache();
+
+    MetricsCache(const MetricsCache&) = delete;
+    MetricsCache& operator=(const MetricsCache&) = delete;
+
+    // Returns false if the frame has no record with at least the given state.
+    bool read(int n, uint32_t state, FrameMetrics& m) const noexcept;
+    void write(int n, const FrameMetrics& m) noexcept;
+};
@@ -0,0 +1,93 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int threads) : stop(false)
+{
+    for (int i{ 1 }; i < threads; ++i)
+        workers.emplace_back(&ThreadPool::worker, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+    }
+
+    cv.notify_all();
+
+    for (auto& t : workers)
+        t.join();
+}
+
+void ThreadPool::execute(const Task& task) noexcept
+{
+    (*task.job)();
+
+    // The batch lives on the stack of run(), so it must not be touched after the owner is allowed to return.
+    std::lock_guard<std::mutex> lock(task.batch->mtx);
+    if (--task.batch->pending == 0)
+        task.batch->done.notify_one();
+}
+
+void ThreadPool::worker() noexcept
+{
+    while (true)
+    {
+        Task task;
+
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this] { return stop || !tasks.empty(); });
+
+            if (stop && tasks.empty())
+                return;
+
+            task = tasks.front();
+            tasks.pop_front();
+        }
+
+        execute(task);
+    }
+}
+
+void ThreadPool::run(const std::vector<std::function<void()>>& jobs) noexcept
+{
+    if (workers.empty() || jobs.size() < 2)
+    {
+        for (auto& job : jobs)
+            job();
+
+        return;
+    }
+
+    Batch batch;
+    batch.pending = static_cast<int>(jobs.size());
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto& job : jobs)
+            tasks.push_back({ &job, &batch });
+    }
+
+    cv.notify_all();
+
+    // Help with the queued jobs instead of sleeping.
+    while (batch.pending > 0)
+    {
+        Task task;
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (tasks.empty())
+                break;
+
+            task = tasks.front();
+            tasks.pop_front();
+        }
+
+        execute(task);
+    }
+
+    std::unique_lock<std::mutex> lock(batch.mtx);
+    batch.done.wait(lock, [&batch] { return batch.pending == 0; });
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads.
+// run() may be called from several threads at once (MT_NICE_FILTER); the calling thread executes jobs too.
+class ThreadPool
+{
+    struct Batch
+    {
+        std::atomic<int> pending;
+        std::mutex mtx;
+        std::condition_variable done;
+    };
+
+    struct Task
+    {
+        const std::function<void()>* job;
+        Batch* batch;
+    };
+
+    std::vector<std::thread> workers;
+    std::deque<Task> tasks;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stop;
+
+    void execute(const Task& task) noexcept;
+    void worker() noexcept;
+
+public:
+    // threads includes the calling thread, so threads - 1 workers are started.
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Runs all jobs and returns when all of them are finished.
+    void run(const std::vector<std::function<void()>>& jobs) noexcept;
+};